@@ -14,6 +14,9 @@ use JSON;
 use Time::HiRes;
 use File::Copy;
 use URI;
+use FindBin;
+BEGIN { push @INC, "$FindBin::Bin/lib" }
+use GASpecFrames;
 use warnings;
 use strict;
 
@@ -136,6 +139,7 @@ sub mythread {
                 my $id = fileno($client);
                 $uniqclientid++;
                 $socks{$id} = { id => $id, sock => $client, buf => '',
+                                lines => [], binary => 0,
                                 uniqid => $uniqclientid,
                                 config => '', configfile => undef,
                                 remaining => 0, gentime => 0,
@@ -177,6 +181,7 @@ sub WorkReturned {
     my $fatal = 0;
     my $nreturned = 0;
     my $failed = $command eq 'FAILED';
+    my $results = '';   # Results for a source using the binary protocol
     if ( $reply->{files} && @{$reply->{files}} ) {
         my ($valid, undef, $fn) = @{$reply->{files}[0]};
         my ($checksum, $buf);
@@ -218,9 +223,15 @@ sub WorkReturned {
                     { warn "No gasock"; $source = -1 }
                 # Return the item to that source
                 $gasock = $socks{$source}{sock};
-                printf $gasock "F %d %s\n",
-                    $items[$item]{origindex},
-                    $items[$item]{fitness};
+                if ( $socks{$source}{binary} ) {
+                    $results .= PackResult($items[$item]{origindex},
+                                           $items[$item]{fitness});
+                }
+                else {
+                    printf $gasock "F %d %s\n",
+                        $items[$item]{origindex},
+                        $items[$item]{fitness};
+                }
                 $socks{$source}{remaining}--;
                 $nreturned++;
                 $items[$item] = undef;
@@ -230,6 +241,9 @@ sub WorkReturned {
         else { warn "Checksum mismatch on $fn" }
     }
     else { warn "Error or no files on finished work" }
+    # A workunit only holds items from one source, so its results go out in
+    # a single frame.
+    SendResults($socks{$source}, $results) if length($results);
     if ( $fatal ) {
         # Get rid of this GA instance
         # FIXME
@@ -261,7 +275,7 @@ sub WorkReturned {
         if ( $socks{$source}{remaining} != 0 )
             { warn "Source $source has $socks{$source}{remaining} remaining" }
         if ( !$gasock ) { warn "No gasock" }
-        print $gasock "DONE\n";
+        SendDone($socks{$source});
         # Provisional generation duration.
         $socks{$source}{gentime} = Time::HiRes::time-$socks{$source}{genstart};
     }
@@ -315,8 +329,7 @@ sub RemoveFileDependency {
 
 sub HandleSocket {
     my ($id) = @_;
-    while ( $socks{$id}{buf} =~ s/^(.*?)\r*\n// ) {
-        my $l = $1;
+    while ( defined(my $l = NextLine($socks{$id})) ) {
         print "G$id: $l\n" unless $l =~ m/^I /;
         if ( $l =~ m/^V .+$/ ) {
             my $configdata = $socks{$id}{config} . "$l\n";
@@ -344,6 +357,11 @@ sub HandleSocket {
             push @{$socks{$id}{files}},
                          [$checksum, "$TEMPURL/$fn", "$REMOTETEMPDIR/$fn"];
         }
+        elsif ( $l =~ m/^BINARY (\d+)/ ) {
+            # Everything after this line is framed
+            warn "Unsupported binary protocol version $1" if $1 != 1;
+            $socks{$id}{binary} = 1;
+        }
         elsif ( $l =~ m/^G (\d+)/ ) {
             $socks{$id}{gen} = $1;
             $socks{$id}{wucount} = 'aaa';
@@ -373,10 +391,7 @@ sub HandleSocket {
                 }
             }
             # Received empty population (entire population was in GA cache)
-            if ( !$founditems ) {
-                my $gasock = $socks{$id}{sock};
-                print $gasock "DONE\n";
-            }
+            if ( !$founditems ) { SendDone($socks{$id}) }
             else {
                 TrySending();
             }
@@ -392,9 +407,11 @@ sub HandleSocket {
             # Remove existing configuration items and dependency files.
             # Note: By default, perlre's $ will ignore newlines at the end of
             #       the string.
-            # Do NOT do this for amin, amax, ..., delkmin, delkmax, as those
-            # options can be specified multiple times.
-            if ( $opt !~ m/(min|max)$/ && $socks{$id}{config} =~
+            # Do NOT do this for amin, amax, ..., delkmin, delkmax, or for
+            # match and its match-* settings, as those options can be
+            # specified multiple times.
+            if ( $opt !~ m/(min|max)$/ && $opt !~ m/^match/ &&
+                 $socks{$id}{config} =~
                     s/(^|\n)CFG[A-Z0-9] $opt( ([^\n]*))?(\n|$)/$1/ &&
                  @suffixes && $3 ) {
                 # Remove obsolete dependency files
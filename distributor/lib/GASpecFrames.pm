@@ -0,0 +1,83 @@
+#
+# GASpecFrames.pm - Binary distributor protocol of ga-spectroscopy
+#
+# Used by gaspecdist.pl and localdist.pl to talk to ga-spectroscopy
+# --binary-protocol (see GA_DIST_VERSION in ga.h for the frame layout).
+# A connection is a hash with the socket (sock), bytes read but not yet
+# handled (buf), decoded lines not yet handled (lines), whether the binary
+# protocol is in use (binary) and the current generation (gen).
+#
+package GASpecFrames;
+use Exporter 'import';
+use warnings;
+use strict;
+
+our @EXPORT = qw(NextLine FrameToLines SendFrame PackResult SendResults
+                 SendDone);
+
+# Get the next line from a ga-spectroscopy connection. With the binary
+# protocol, frames are converted to the equivalent text protocol lines.
+sub NextLine {
+    my ($c) = @_;
+    while ( $c->{binary} && !@{$c->{lines}} && length($c->{buf}) >= 4 ) {
+        # 4-byte length, type byte, payload
+        my $len = unpack 'N', $c->{buf};
+        last if length($c->{buf}) < 4+$len;
+        my ($type, $payload) = unpack 'a a*', substr($c->{buf}, 4, $len);
+        substr($c->{buf}, 0, 4+$len) = '';
+        push @{$c->{lines}}, FrameToLines($type, $payload);
+    }
+    return shift @{$c->{lines}} if @{$c->{lines}};
+    return undef if $c->{binary};
+    return $c->{buf} =~ s/^(.*?)\r*\n// ? $1 : undef;
+}
+
+# Convert a binary protocol frame to the equivalent text protocol lines
+sub FrameToLines {
+    my ($type, $payload) = @_;
+    if ( $type eq 'T' ) { return split /\r*\n/, $payload }
+    elsif ( $type eq 'I' ) {
+        my ($gen, $nseg, $segsize) = unpack 'N3', $payload;
+        my $format = 'N ' . ($segsize == 8 ? 'Q>' : 'N') . $nseg;
+        my $itemsize = 4+$nseg*$segsize;
+        my @lines = ();
+        for ( my $p = 12; $p+$itemsize <= length($payload); $p += $itemsize ) {
+            my ($index, @values) = unpack $format, substr($payload, $p);
+            push @lines, "I $index " . join(' ', map {sprintf '%x', $_} @values);
+        }
+        return @lines;
+    }
+    elsif ( $type eq 'G' ) {
+        my ($gen) = unpack 'N', $payload;
+        return ("G $gen", 'DISPATCH');
+    }
+    warn "Unknown frame type '$type' from ga-spectroscopy";
+    return ();
+}
+
+# Send a frame to a ga-spectroscopy process using the binary protocol
+sub SendFrame {
+    my ($sock, $type, $payload) = @_;
+    print $sock pack('N a', 1+length($payload), $type), $payload;
+}
+
+# One result, for SendResults
+sub PackResult {
+    my ($index, $fitness) = @_;
+    return pack 'N d>', $index, $fitness;
+}
+
+# Send results packed with PackResult, as one frame
+sub SendResults {
+    my ($c, $results) = @_;
+    SendFrame($c->{sock}, 'R', pack('N', $c->{gen}) . $results);
+}
+
+# Tell a ga-spectroscopy process that its generation is complete
+sub SendDone {
+    my ($c) = @_;
+    if ( $c->{binary} ) { SendFrame($c->{sock}, 'D', pack('N', $c->{gen})) }
+    else { print {$c->{sock}} "DONE\n" }
+}
+
+1;
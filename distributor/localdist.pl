@@ -0,0 +1,158 @@
+#!/usr/bin/perl
+#
+# localdist.pl - Local stand-in for gaspecdist.pl
+#
+# Accepts ga-spectroscopy --distributed connections like gaspecdist.pl, but
+# evaluates each generation with ga-spectroscopy-client processes on this
+# machine instead of sending workunits to the Server. Items are streamed to
+# the clients' standard input and results are returned as the clients report
+# them, so ga-spectroscopy sees them in batches and out of order. Speaks both
+# the text protocol and the binary protocol (--binary-protocol).
+#
+# Usage: localdist.pl [options] [path to ga-spectroscopy-client]
+#   --port N      Port to listen on for ga-spectroscopy (default 2222)
+#   --clients N   Client processes per generation (default 2)
+#   --threads N   Threads per client process (-T)
+#
+use IO::Socket::INET;
+use IO::Select;
+use IPC::Open2;
+use File::Temp;
+use Getopt::Long;
+use POSIX ":sys_wait_h";
+use FindBin;
+BEGIN { push @INC, "$FindBin::Bin/lib" }
+use GASpecFrames;
+use warnings;
+use strict;
+
+my ($LHOST, $LPORT) = ('localhost', 2222);
+my $NCLIENTS = 2;
+my $THREADS;
+GetOptions('port=i' => \$LPORT, 'clients=i' => \$NCLIENTS,
+           'threads=s' => \$THREADS)
+    or die "Usage: $0 [--port N] [--clients N] [--threads N] [client]\n";
+my $CLIENT = @ARGV ? $ARGV[0] : './ga-spectroscopy-client';
+$NCLIENTS = 1 if $NCLIENTS < 1;
+
+my $galisten = IO::Socket::INET->new(LocalAddr => $LHOST, LocalPort => $LPORT,
+                                     Listen => 5, Reuse => 1)
+    or die "Cannot listen on $LHOST:$LPORT: $!";
+local $SIG{'PIPE'} = 'IGNORE';
+
+print "localdist ready\n";
+while ( my $sock = $galisten->accept() ) {
+    my $ga = { sock => $sock, buf => '', lines => [], binary => 0,
+               config => '', version => undef, gen => 0, items => [] };
+    print "Connection from ga-spectroscopy\n";
+    while ( 1 ) {
+        my $l = NextLine($ga);
+        if ( !defined($l) ) {
+            my $rc = sysread($sock, $ga->{buf}, 65536, length($ga->{buf}));
+            warn "sysread failed: $!" unless defined($rc);
+            last unless $rc;
+            next;
+        }
+        HandleLine($ga, $l);
+    }
+    close $sock;
+    print "ga-spectroscopy disconnected\n";
+}
+
+sub HandleLine {
+    my ($ga, $l) = @_;
+    if ( $l =~ m/^V .+$/ ) { $ga->{version} = "$l\n" }
+    elsif ( $l =~ m/^BINARY (\d+)/ ) {
+        warn "Unsupported binary protocol version $1" if $1 != 1;
+        $ga->{binary} = 1;
+    }
+    elsif ( $l =~ m/^I (\d+) (.+)$/ ) { push @{$ga->{items}}, [$1, $2] }
+    elsif ( $l =~ m/^G (\d+)/ ) { $ga->{gen} = $1 }
+    elsif ( $l =~ m/^DISPATCH/ ) {
+        RunGeneration($ga);
+        $ga->{items} = [];
+    }
+    elsif ( $l =~ m/^(CFG[A-Z0-9]) (\S+)(?: (.+))?/ ) {
+        my ($type, $opt, $val) = ($1, $2, $3);
+        # Later settings replace earlier ones, except for the options which
+        # may be given more than once (see gaspecdist.pl).
+        $ga->{config} =~ s/(^|\n)CFG[A-Z0-9] $opt( [^\n]*)?(\n|$)/$1/
+            if $opt !~ m/(min|max)$/ && $opt !~ m/^match/;
+        $ga->{config} .= "$type $opt" . (defined($val) ? " $val\n" : "\n");
+    }
+    else { warn "Unknown line from ga-spectroscopy: $l" }
+}
+
+# Evaluate the dispatched items of a generation
+sub RunGeneration {
+    my ($ga) = @_;
+    my $items = $ga->{items};
+    my $read = IO::Select->new();
+    my $write = IO::Select->new();
+    my %jobs = ();
+    my $per = int((@$items+$NCLIENTS-1)/$NCLIENTS);
+    for ( my $i = 0; $i < @$items; $i += $per ) {
+        my $end = $i+$per < @$items ? $i+$per : scalar(@$items);
+        my $input = $ga->{config} . $ga->{version} . "G $ga->{gen}\n";
+        $input .= "I $_->[0] $_->[1]\n" foreach @$items[$i..$end-1];
+        # The client's output file only matters for resuming
+        my $outfile = File::Temp->new(TEMPLATE => 'localdist-XXXXX',
+                                      TMPDIR => 1);
+        my @cmd = ($CLIENT, defined($THREADS) ? ('-T', $THREADS) : (),
+                   '-', $outfile->filename);
+        my ($out, $in);
+        my $pid = open2($out, $in, @cmd);
+        $in->blocking(0);
+        $jobs{fileno($out)} = { pid => $pid, in => $in, input => $input,
+                                outfile => $outfile, buf => '',
+                                message => '' };
+        $jobs{fileno($in)} = $jobs{fileno($out)};
+        $read->add($out);
+        $write->add($in);
+    }
+    my $nreturned = 0;
+    while ( $read->count() ) {
+        my ($readable, $writable) = IO::Select->select($read, $write, undef);
+        foreach my $fh ( @{$writable || []} ) {
+            my $job = $jobs{fileno($fh)};
+            my $rc = syswrite($fh, $job->{input});
+            if ( !defined($rc) ) {
+                next if $!{EAGAIN};
+                warn "Write to client $job->{pid} failed: $!";
+                $job->{input} = '';
+            }
+            else { substr($job->{input}, 0, $rc) = '' }
+            if ( !length($job->{input}) ) {
+                $write->remove($fh);
+                close $fh;
+            }
+        }
+        my $results = '';
+        foreach my $fh ( @{$readable || []} ) {
+            my $job = $jobs{fileno($fh)};
+            my $rc = sysread($fh, $job->{buf}, 65536, length($job->{buf}));
+            while ( $job->{buf} =~ s/^(.*?)\r*\n// ) {
+                my $l = $1;
+                if ( $l =~ m/^F (\d+) (\S+) E/ ) {
+                    $results .= $ga->{binary} ? PackResult($1, $2)
+                                              : "F $1 $2\n";
+                    $nreturned++;
+                }
+                elsif ( length($l) ) { $job->{message} = $l }
+            }
+            next if $rc;
+            $read->remove($fh);
+            close $fh;
+            waitpid($job->{pid}, 0);
+            warn "Client $job->{pid} exited with status $?: $job->{message}\n"
+                if $?;
+        }
+        next unless length($results);
+        if ( $ga->{binary} ) { SendResults($ga, $results) }
+        else { print {$ga->{sock}} $results }
+    }
+    warn "Only $nreturned of " . @$items . " items returned\n"
+        if $nreturned != @$items;
+    SendDone($ga);
+    printf "Generation %d: %d items\n", $ga->{gen}, $nreturned;
+}
@@ -1,5 +1,6 @@
 #ifndef _HAVE_GA_CLIENTONLY_H
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdarg.h>
 #include <stdio.h>
 
@@ -9,23 +10,18 @@
  *  - tprintf is #defined to printf rather than a thread-safe wrapper for it.
  *  - qprintf is a plain wrapper for vprintf.
  */
-#if !defined(GA_segment) || !defined(GA_segment_size)
-/** The type of a segment. This is expected to be some kind of
- * integer-type. The bit-width of the type must be specified in
- * GA_segment_size.
- */
-#define GA_segment uint32_t
-/** The size, in bits, of a segment. */
-#define GA_segment_size 32
-#warning Using default GA_segment definition
-#endif
+#include "ga-segment.h"
 
 typedef struct GA_individual_struct {
   GA_segment *gdsegments;
   double fitness;
 } GA_individual;
-typedef struct { void *ref; } GA_settings;
-typedef struct { GA_settings *settings; unsigned int generation; } GA_session;
+typedef struct { char optsource; void *ref; } GA_settings;
+typedef struct {
+  GA_settings *settings;
+  unsigned int generation;
+  double threshold;
+} GA_session;
 typedef struct { void *ref; GA_session *session; } GA_thread;
 
 extern int GA_starting_generation(GA_session *ga);
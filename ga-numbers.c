@@ -6,17 +6,39 @@
 #include <stdlib.h>
 #include <time.h>
 #include <math.h>
+#include <string.h>
+#include <pthread.h>
 #include "ga.h"
 
 #define POPULATION  64
 #define GENERATIONS 150 
 
+/* Number of independent sessions to run for --sessions */
+static int sessions = 0;
+/* Set by --check-kernels */
+static int checkkernels = 0;
+
+/** One independent run, for --sessions */
+typedef struct {
+  GA_settings settings;
+  int target;
+  int rc;
+  double fitness;               /* Best unscaled fitness */
+  GA_segment best;              /* Best individual */
+} numbers_run;
+
 int my_parseopt(const struct option *long_options, GA_settings *settings,
 		int c, int option_index) {
   switch (c) {
   case 'n':
     *(int *)(settings->ref) = atoi(optarg);
     break;
+  case 20: /* --sessions */
+    sessions = atoi(optarg);
+    break;
+  case 21: /* --check-kernels */
+    checkkernels = 1;
+    break;
 
   default:
     printf("Aborting: %c\n",c);
@@ -25,11 +47,64 @@ int my_parseopt(const struct option *long_options, GA_settings *settings,
   return 0;
 }
 
+/* Run a whole session (GA_init through GA_cleanup) for --sessions. */
+static void *run_session(void *arg) {
+  numbers_run *run = (numbers_run *)arg;
+  GA_session ga;
+  run->settings.ref = &run->target;
+  if ( (run->rc = GA_init(&ga, &run->settings, 1)) != 0 ) return NULL;
+  if ( (run->rc = GA_evolve(&ga, 0)) != 0 ) return NULL;
+  run->fitness = ga.population[ga.fittest].unscaledfitness;
+  run->best = ga.population[ga.fittest].gdsegments[0];
+  run->rc = GA_cleanup(&ga);
+  return NULL;
+}
+
+/* Stress test for reentrancy: run several sessions one at a time, then
+ * all at once on separate threads, and check that the results match. */
+static int run_sessions(const GA_settings *settings, int target) {
+  numbers_run *seq, *par;
+  pthread_t *tids;
+  int i, bad = 0;
+  seq = malloc(sizeof(numbers_run)*sessions);
+  par = malloc(sizeof(numbers_run)*sessions);
+  tids = malloc(sizeof(pthread_t)*sessions);
+  if ( !seq || !par || !tids ) { printf("Out of memory (sessions)\n"); return 1; }
+  for ( i = 0; i < sessions; i++ ) {
+    memset(&seq[i], 0, sizeof(numbers_run));
+    seq[i].settings = *settings;
+    seq[i].settings.randomseed = settings->randomseed+i;
+    seq[i].target = target+i;
+    par[i] = seq[i];
+  }
+  for ( i = 0; i < sessions; i++ ) run_session(&seq[i]);
+  for ( i = 0; i < sessions; i++ ) {
+    if ( pthread_create(&tids[i], NULL, run_session, &par[i]) != 0 ) {
+      printf("Could not start session %d\n", i);
+      return 1;
+    }
+  }
+  for ( i = 0; i < sessions; i++ ) pthread_join(tids[i], NULL);
+  for ( i = 0; i < sessions; i++ ) {
+    int match = seq[i].rc == 0 && par[i].rc == 0 &&
+      seq[i].best == par[i].best && seq[i].fitness == par[i].fitness;
+    printf("SESS %03d seed %u best %" GA_PRIu " %s\n", i,
+           seq[i].settings.randomseed, par[i].best,
+           match ? "ok" : "MISMATCH");
+    if ( !match ) bad++;
+  }
+  printf("%d of %d concurrent sessions matched\n", sessions-bad, sessions);
+  free(seq); free(par); free(tids);
+  return bad ? 1 : 0;
+}
+
 int main(int argc, char *argv[]) {
   GA_session ga;
   GA_settings settings;
   static const struct option my_long_options[] = {
     {"number",     required_argument,       0, 'n'},
+    {"sessions",   required_argument,       0, 20},
+    {"check-kernels", no_argument,          0, 21},
     {0, 0, 0, 0}
   };
   int rc = 0;
@@ -41,6 +116,8 @@ int main(int argc, char *argv[]) {
   settings.ref = &target;
   GA_getopt(argc,argv, &settings, "n:", my_long_options, my_parseopt, "",
 	    NULL);
+  if ( checkkernels ) return GA_check_kernels() ? 1 : 0;
+  if ( sessions > 0 ) return run_sessions(&settings, target);
 
   if ( (rc = GA_init(&ga, &settings, 1)) != 0 ) {
     printf("GA_init failed: %d\n", rc);
@@ -77,6 +154,10 @@ int GA_fitness_quick(const GA_session *ga, GA_individual *elem) {
   return 1;
 }
 
+int GA_repair(const GA_session *ga, GA_individual *elem) {
+  return 0;
+}
+
 GA_segment GA_random_segment(GA_session *ga, const unsigned int i,
                              const unsigned int j) {
   return GA_rand(ga);
@@ -0,0 +1,38 @@
+/** \file ga-segment.h
+ *
+ * GA_segment definition, shared by ga.h and ga-clientonly.h.
+ */
+#ifndef _HAVE_GA_SEGMENT_H
+#include <stdint.h>
+#include <inttypes.h>
+
+#if !defined(GA_segment) || !defined(GA_segment_size)
+/** The type of a segment. This is expected to be some kind of
+ * integer-type. The bit-width of the type must be specified in
+ * GA_segment_size.
+ */
+#define GA_segment uint32_t
+/** The size, in bits, of a segment. */
+#define GA_segment_size 32
+#warning Using default GA_segment definition
+#endif
+
+/** \name GA_segment format conversions
+ * printf/scanf conversion specifiers for a GA_segment, for example
+ * printf("%" GA_PRIu "\n", x).
+ * \{ */
+#if GA_segment_size == 64
+#define GA_PRIu PRIu64
+#define GA_PRIx PRIx64
+#define GA_SCNu SCNu64
+#define GA_SCNx SCNx64
+#else
+#define GA_PRIu PRIu32
+#define GA_PRIx PRIx32
+#define GA_SCNu SCNu32
+#define GA_SCNx SCNx32
+#endif
+/* \} */
+
+#define _HAVE_GA_SEGMENT_H
+#endif
@@ -40,9 +40,33 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <spawn.h>
+#include <sched.h>
+#include "spcat-obj/spcat-pipe.h"
+pid_t spawn_redirected(char *const argv[], int stdinfd, int stdoutfd);
 int invisible_system(int stdoutfd, int argc, ...);
 #endif
 
+/* Suffix for the version tag sent to distributed clients. Clients must be
+ * built from the same source and with the same segment width. */
+#define STRINGIFY_(x) #x
+#define STRINGIFY(x) STRINGIFY_(x)
+#if GA_segment_size == 32
+#define SEGMENT_TAG ""
+#else
+#define SEGMENT_TAG "-" STRINGIFY(GA_segment_size)
+#endif
+
+/* Also build AVX2 versions of loops that benefit from it, picked at run
+ * time (GCC function multiversioning, needs ifunc support) */
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && \
+    defined(__linux__)
+#define VECTOR_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define VECTOR_CLONES
+#endif
+
 #ifndef O_NOFOLLOW      /* If unsupported, symlinks probably aren't either. */
 #define O_NOFOLLOW 0
 #endif
@@ -76,6 +100,7 @@ const char output_suffixes[2][4] = {"out", "cat"};
 /** One row of a .CAT file */
 typedef struct {
   float frequency, error, intensity;
+  float elo;                    /* Lower state energy, cm-1 */
   int qn[QN_COUNT*QN_DIGITS];
 } datarow;
 typedef struct {
@@ -86,6 +111,116 @@ typedef struct {
   int npeaks;
   float *peaks;
 } dblres_relation;
+/** A computed peak in the double resonance frequency index */
+typedef struct {
+  float frequency;
+  int index;                    /* Row of compdata */
+} dr_peak;
+/* Kinds of compiled template span */
+#define TSPAN_TEXT  0   /* Literal text */
+#define TSPAN_G     1   /* %gN: x[N]E-05 */
+#define TSPAN_GSUM  2   /* %gN, B with --linkbc: ((x[N]+x[N+1])/2)E-05 */
+#define TSPAN_GDIFF 3   /* %gN, C with --linkbc: ((x[N-1]-x[N])/2)E-05 */
+#define TSPAN_GZERO 4   /* %gN, distortion constants: signed, E-12 */
+#define TSPAN_E     5   /* %eN: error estimate */
+/** One piece of a compiled template */
+typedef struct {
+  int type;                     /* TSPAN_* */
+  unsigned int index;           /* Segment index, unless TSPAN_TEXT */
+  const char *text;             /* Literal text (TSPAN_TEXT) */
+  size_t len;
+} template_span;
+typedef struct {
+  unsigned int nspans;
+  template_span *spans;
+} template_subfile;
+/** A template compiled by compile_template, one span list per subfile */
+typedef struct {
+  unsigned int nsubfiles;
+  template_subfile *subfiles;
+} compiled_template;
+/** The segments that one subfile's SPCAT input is rendered from */
+typedef struct {
+  unsigned int nsegments;
+  unsigned int *segments;       /* Segment indices, ascending */
+  float temperature;            /* TEMP of the .int, or 0 if not literal */
+} subfile_inputs;
+/** Growable buffer that templates are rendered into */
+typedef struct {
+  char *buf;
+  size_t len, size;
+} render_buffer;
+/** One cached SPCAT result (see spectrum_cache) */
+typedef struct spectrum_entry {
+  struct spectrum_entry *hnext; /* Next in hash bucket */
+  struct spectrum_entry *newer, *older; /* LRU list */
+  unsigned int hash;
+  size_t size;                  /* Bytes charged against the budget */
+  unsigned int keylen;
+  GA_segment *key;              /* The segments SPCAT's input came from */
+  int count;
+  datarow *rows;                /* The parsed .cat output (log10 intensities,
+                                   normalized when assembled) */
+} spectrum_entry;
+/** Parsed SPCAT output of recently evaluated genomes, so they can be
+ * rescored (e.g. with a different bin count) without running SPCAT again.
+ * Least recently used entries are dropped to stay within budget. */
+typedef struct {
+  size_t budget, used;          /* Bytes */
+  unsigned int nbuckets, nentries;
+  spectrum_entry **buckets;
+  spectrum_entry *newest, *oldest;
+  unsigned long hits, misses;
+#if THREADS
+  pthread_mutex_t mutex;
+#endif
+} spectrum_cache;
+/* Compiled observations (--compile-observation): the rows as
+ * load_spec_observation leaves them, then the observation binned for the bin
+ * counts a run is expected to use, so that loading is a single map_file.
+ * The layout is that of the machine that wrote it. */
+#define OBSBLOB_MAGIC   "GASPOBS"       /* 8 bytes, with the NUL */
+#define OBSBLOB_VERSION 1
+#define OBSBLOB_MAXHIST 64
+#define OBSBLOB_ALIGN(n) (((n)+7) & ~(size_t)7)
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t rowsize;             /* sizeof(datarow) */
+  uint32_t count;               /* Rows, then histograms, follow */
+  uint32_t nhist;
+  uint32_t rangemin, rangemax;  /* --rangemin/--rangemax of the histograms */
+  uint64_t checksum;            /* obsblob_checksum of the rest of the file */
+} obsblob_header;
+/** One histogram: followed by nbins doubles (obsbin) and nbins ints
+ * (obsbincount), padded to 8 bytes */
+typedef struct {
+  uint32_t nbins, pad;
+} obsblob_hist;
+/** An observed spectrum to fit against (--match) */
+typedef struct {
+  char *file;
+  const obsblob_header *blob;   /* Compiled observation rows point into */
+  size_t blobsize;
+  float weight;                 /* Of this spectrum's score in the fitness */
+  float temperature;            /* Rescale intensities to this, 0 for TEMP */
+  unsigned int bins;            /* Fixed number of bins, 0 for scaledbins */
+  datarow *rows;                /* Data storage for observation */
+  int size, count;
+  unsigned int nbins;           /* Bins that obsbin was built for */
+  double *obsbin;               /* Binned observation (see bin_observation) */
+  int *obsbincount;
+  int *strong;                  /* Most intense bins (--early-exit) */
+  int nstrong;
+} spec_observation;
+/** Computed peaks binned like one observation (see bin_computed) */
+typedef struct {
+  double *compbin;
+  int *compbincount;
+  double *binweights;           /* 20110215, J-weighting */
+  double *binerror;             /* 20110804, Error propagation */
+  int size;
+} computed_bins;
 /** Thread-local data */
 typedef struct {
   datarow *compdata;            /* Data storage for comparison */
@@ -95,12 +230,26 @@ typedef struct {
 #endif
   dblres_check *drlist;
   int drsize;
+  int *drhead, *drnext;         /* QN hash chains over drlist (see qn_hash) */
+  unsigned int drhashsize;      /* Buckets in drhead, a power of two */
+  dr_peak *drorder;             /* compdata sorted by frequency */
+  int *drnear;                  /* Result of dr_near_peaks */
+  int drordersize;
+  float *errors;                /* Scratch space for the error tolerance */
+  int errorssize;
+  datarow *rescaled;            /* compdata at another temperature */
+  int rescaledsize;
+  computed_bins *cbins;         /* One per observation */
+  render_buffer input[2];       /* Rendered .int and .var */
+#ifndef _WIN32
+  pid_t spcatpid;               /* SPCAT server (--spcat-pool), or 0 */
+  int spcatin, spcatout;        /* Pipes to its stdin and from its stdout */
+#endif
 } specthreadopts_t;
 /** Settings */
 typedef struct {
   char *basename_out;           /* Basename of output file */
   char *template_fn;            /* Filename of template file */
-  char *obsfile;                /* Observation file */
   char *spcatbin;               /* SPCAT program file */
   unsigned int bins;            /* Number of bins */
   float binscale;               /* Scaling to apply each generation */
@@ -108,15 +257,20 @@ typedef struct {
   unsigned int scaledbins;      /* Current bins, if changes each generation */
   float distanceweight;
   int stdoutfd, devnullfd;      /* File descriptors used to hide SPCAT output */
-  datarow *observation;         /* Data storage for observation */
-  int observationsize, observationcount;
-  char template[2][2048];       /* Input file template (FIXME: Fixed length) */
+  spec_observation *obs;        /* --match, in command line order */
+  unsigned int nobs;
+  int argsmatch;                /* --match was given on the command line */
+  const char *template[2];      /* Input file templates (mapped, read-only) */
+  size_t templatesize[2];
+  compiled_template compiled[2];
+  subfile_inputs *subfileinputs; /* Per subfile, see find_subfile_inputs */
+  unsigned int nsubfileinputs;
   float errordecay;
   unsigned int *userange;       /* Size of range params SEGMENTS*rangesize */
   unsigned int *rangetemp;
   GA_segment *rangemin;
   GA_segment *rangemax;
-  unsigned int *initialerror;   /* Size is also SEGMENTS*rangesize */
+  GA_segment *initialerror;     /* Size is also SEGMENTS*rangesize */
   unsigned int rangesize;       /* Number of components with range bounds */
   unsigned int componentcount;  /* Number of components being fit */
   char *popfile;
@@ -130,8 +284,22 @@ typedef struct {
   char *distributor;
   char *tempdir;
   int compress;                 /* Compression mode for output log file */
+  int spcatpool;                /* Use persistent SPCAT servers */
+  spectrum_cache *speccache;    /* --spectrum-cache, or NULL */
+  unsigned int speccachemb;
+  float earlyexit;              /* --early-exit fraction of bins, or 0 */
+  double spcatwinmin, spcatwinmax; /* See set_spcat_window */
+  int pruneblocks;              /* --prune-blocks */
+  char *compileobs;             /* --compile-observation output file */
 } specopts_t;
 
+spectrum_cache *spectrum_cache_new(size_t budget);
+void spectrum_cache_free(spectrum_cache *sc);
+#ifndef CLIENT_ONLY
+int compile_observation(specopts_t *opts, unsigned int generations,
+                        const char *filename);
+#endif
+
 #ifndef USE_SPCAT_OBJ
 char *make_spec_temp(char *dir) {
   int i = 0;
@@ -176,6 +344,299 @@ char *make_spec_temp(char *dir) {
 }
 #endif
 
+/** Start a new (empty) subfile in a compiled template. */
+int template_add_subfile(compiled_template *ct) {
+  template_subfile *sf;
+  sf = realloc(ct->subfiles, sizeof(template_subfile)*(ct->nsubfiles+1));
+  if ( !sf ) return -1;
+  ct->subfiles = sf;
+  sf[ct->nsubfiles].nspans = 0;
+  sf[ct->nsubfiles].spans = NULL;
+  ct->nsubfiles++;
+  return 0;
+}
+
+/** Append a span to the last subfile of a compiled template. */
+int template_add_span(compiled_template *ct, int type, unsigned int index,
+                      const char *text, size_t len) {
+  template_subfile *sf = &ct->subfiles[ct->nsubfiles-1];
+  template_span *sp;
+  /* Merge literal text that directly follows the previous literal */
+  if ( type == TSPAN_TEXT && sf->nspans &&
+       sf->spans[sf->nspans-1].type == TSPAN_TEXT &&
+       sf->spans[sf->nspans-1].text+sf->spans[sf->nspans-1].len == text ) {
+    sf->spans[sf->nspans-1].len += len;
+    return 0;
+  }
+  sp = realloc(sf->spans, sizeof(template_span)*(sf->nspans+1));
+  if ( !sp ) return -1;
+  sf->spans = sp;
+  sp += sf->nspans++;
+  sp->type = type;
+  sp->index = index;
+  sp->text = text;
+  sp->len = len;
+  return 0;
+}
+
+/** Compile input template i (see input_suffixes) into literal spans and
+ * parameter slots, one list per subfile, so that rendering an individual
+ * needs no parsing.
+ *
+ * Template syntax: %gN is replaced by segment N and %eN by the error
+ * estimate for segment N; %% is a literal %. $ ends a subfile and deletes
+ * the rest of its line (including the line ending); $$ is a literal $.
+ *
+ * \returns 0 on success.
+ */
+int compile_template(specopts_t *opts, int i) {
+  const char *tmpl = opts->template[i];
+  const size_t len = opts->templatesize[i];
+  compiled_template *ct = &opts->compiled[i];
+  int oldj = 0, j = 0, parsemode = 0;
+  /* The template is not NUL-terminated; treat its end as a NUL. */
+#define TCH(k) ((size_t)(k) < len ? tmpl[k] : 0)
+  ct->nsubfiles = 0;
+  ct->subfiles = NULL;
+  if ( template_add_subfile(ct) ) return -1;
+  for ( j = 0; /* None, uses return */; j++ ) {
+    char c = TCH(j);
+    if ( ( c == '%' ) || ( c == '$' ) || ( c == 0 ) ) {
+      int nitems = j-oldj;
+      if ( parsemode == 0 ) {
+        /* Literal text */
+        if ( nitems && template_add_span(ct, TSPAN_TEXT, 0, tmpl+oldj, nitems) )
+          return -1;
+        if ( c == '$' ) {
+          /* Delete up to end of line, including end-of-line characters. */
+          int hadnewline = 0;
+          while ( TCH(j+1) != 0 && TCH(j+1) != '$' ) {
+            if ( TCH(j) == '\r' || TCH(j) == '\n' ) hadnewline = 1;
+            if ( !hadnewline || TCH(j+1) == '\r' || TCH(j+1) == '\n' ) j++;
+            else break;
+          }
+          /* $$ for literal $ */
+          if ( TCH(j+1) == '$' ) {
+            c = 1; /* Dummy value that's not 0 and not $ */
+            j++;
+            if ( template_add_span(ct, TSPAN_TEXT, 0, "$", 1) ) return -1;
+          }
+          parsemode = 0;
+        }
+        else parsemode = c;
+      }
+      else if ( parsemode == '%' ) {
+        if ( nitems <= 0 ) {
+          /* %% means a plain % sign */
+          if ( template_add_span(ct, TSPAN_TEXT, 0, "%", 1) ) return -1;
+        }
+        else {
+          /* Named escape, extract it */
+          char escape[8], type;
+          int index = 0, modindex = 0, spantype;
+          memset(escape, 0, sizeof(escape));
+          if ( nitems > 7 || nitems < 1 ) {
+            printf("template: Named escape is too long or too short\n");
+            return -1;
+          }
+          strncpy(escape, tmpl+oldj, nitems);
+          index = atoi(escape+1);
+          modindex = index % SEGMENTS;
+          type = escape[0];
+          if ( index < 0 || index >= opts->componentcount*SEGMENTS ) {
+            printf("template: Index out of range %d\n", index);
+            return -1;
+          }
+          if ( type == 'g' ) {
+            if ( modindex == 0 ) spantype = TSPAN_G; /* A */
+            else if ( modindex == 1 ) /* B */
+              spantype = opts->linkbc ? TSPAN_GSUM : TSPAN_G;
+            else if ( modindex == 2 ) /* C */
+              spantype = opts->linkbc ? TSPAN_GDIFF : TSPAN_G;
+            else spantype = TSPAN_GZERO; /* DJ, DJK, DK, delJ, delK */
+          }
+          else if ( type == 'e' ) spantype = TSPAN_E;
+          else {
+            printf("template: Unknown escape type %c\n", type);
+            return -1;
+          }
+          if ( template_add_span(ct, spantype, index, NULL, 0) ) return -1;
+        }
+        parsemode = 0;
+      }
+      oldj = j+1;
+      if ( c == 0 ) return 0; /* End of template */
+      if ( c == '$' && template_add_subfile(ct) ) return -1;
+    }
+  }
+}
+#undef TCH
+
+void free_template(compiled_template *ct) {
+  unsigned int k;
+  for ( k = 0; k < ct->nsubfiles; k++ ) free(ct->subfiles[k].spans);
+  free(ct->subfiles);
+  ct->subfiles = NULL;
+  ct->nsubfiles = 0;
+}
+
+/** Read the temperature SPCAT computes intensities at (TEMP, the 9th
+ * field of the second line) from one subfile of the .int template.
+ *
+ * \returns The temperature in K, or 0 if that line is missing, malformed
+ *     or not literal text.
+ */
+float template_temperature(const template_subfile *sf) {
+  char line[256];
+  unsigned int k, n = 0, lineno = 0;
+  float temp = 0;
+  int started = 0;
+  for ( k = 0; k < sf->nspans && lineno < 2; k++ ) {
+    const template_span *sp = &sf->spans[k];
+    size_t j;
+    if ( sp->type != TSPAN_TEXT ) {
+      if ( lineno == 1 ) return 0;
+      started = 1;
+      continue;
+    }
+    for ( j = 0; j < sp->len && lineno < 2; j++ ) {
+      char c = sp->text[j];
+      /* Subfiles after the first start after the '$' */
+      if ( !started && ( c == '\r' || c == '\n' ) ) continue;
+      started = 1;
+      if ( c == '\n' ) lineno++;
+      else if ( lineno == 1 && n < sizeof(line)-1 ) line[n++] = c;
+    }
+  }
+  line[n] = 0;
+  if ( sscanf(line, "%*s %*s %*s %*s %*s %*s %*s %*s %f", &temp) != 1 ||
+       !(temp > 0) )
+    return 0;
+  return temp;
+}
+
+/** Record which segments each subfile of the compiled templates is
+ * rendered from, so that its SPCAT output can be cached per subfile.
+ * Only templates split with '$' gain from this: a template of one subfile
+ * (such as a mixture given as vibrational states) is rendered from all
+ * the segments. Error estimates (%e) are left out: they only vary with
+ * --errordecay, which disables the cache. Also records the temperature of
+ * each subfile, for --match-temp.
+ *
+ * \returns 0 on success, nonzero if out of memory.
+ */
+int find_subfile_inputs(specopts_t *opts) {
+  const unsigned int nseg = opts->componentcount*SEGMENTS;
+  unsigned int n = opts->compiled[0].nsubfiles, k, j;
+  char used[nseg];
+  int i;
+  if ( opts->compiled[1].nsubfiles > n ) n = opts->compiled[1].nsubfiles;
+  opts->subfileinputs = calloc(n ? n : 1, sizeof(subfile_inputs));
+  if ( !opts->subfileinputs ) return 1;
+  opts->nsubfileinputs = n;
+  for ( k = 0; k < n; k++ ) {
+    subfile_inputs *si = &opts->subfileinputs[k];
+    memset(used, 0, nseg);
+    for ( i = 0; i < 2; i++ ) {
+      const template_subfile *sf;
+      if ( k >= opts->compiled[i].nsubfiles ) continue;
+      sf = &opts->compiled[i].subfiles[k];
+      for ( j = 0; j < sf->nspans; j++ ) {
+        const template_span *sp = &sf->spans[j];
+        switch ( sp->type ) {
+        case TSPAN_G: case TSPAN_GZERO: used[sp->index] = 1; break;
+        case TSPAN_GSUM: used[sp->index] = used[sp->index+1] = 1; break;
+        case TSPAN_GDIFF: used[sp->index-1] = used[sp->index] = 1; break;
+        }
+      }
+    }
+    for ( j = 0; j < nseg; j++ ) si->nsegments += used[j];
+    if ( ( si->segments = malloc(sizeof(unsigned int)*(si->nsegments+1)) )
+         == NULL ) return 1;
+    si->nsegments = 0;
+    for ( j = 0; j < nseg; j++ )
+      if ( used[j] ) si->segments[si->nsegments++] = j;
+    if ( k < opts->compiled[0].nsubfiles )
+      si->temperature = template_temperature(&opts->compiled[0].subfiles[k]);
+  }
+  return 0;
+}
+
+void free_subfile_inputs(specopts_t *opts) {
+  unsigned int k;
+  for ( k = 0; k < opts->nsubfileinputs; k++ )
+    free(opts->subfileinputs[k].segments);
+  free(opts->subfileinputs);
+  opts->subfileinputs = NULL;
+  opts->nsubfileinputs = 0;
+}
+
+/** Read a whole file into a new malloc'd buffer (which the caller must
+ * free). The buffer is NUL-terminated, but *size does not include the NUL.
+ *
+ * \returns 0 on success, 10 if the file cannot be opened, 20 if it cannot
+ *     be read.
+ */
+int read_file(const char *filename, char **data, size_t *size) {
+  FILE *fh;
+  char *buf = NULL;
+  size_t len = 0, alloc = 0, n;
+  if ( ( fh = fopen(filename, "r") ) == NULL ) return 10;
+  do {
+    if ( len+1 >= alloc ) {
+      char *nbuf = realloc(buf, alloc = alloc ? alloc*2 : 4096);
+      if ( !nbuf ) { free(buf); fclose(fh); errno = ENOMEM; return 20; }
+      buf = nbuf;
+    }
+    len += ( n = fread(buf+len, 1, alloc-len-1, fh) );
+  } while ( n > 0 );
+  if ( ferror(fh) ) { free(buf); fclose(fh); return 20; }
+  fclose(fh);
+  buf[len] = 0;
+  *data = buf;
+  *size = len;
+  return 0;
+}
+
+/** Load a whole input file into memory. On POSIX systems the file is
+ * mapped read-only, so every thread (and the compiled template spans
+ * pointing into it) shares one copy and loading does not depend on the
+ * file size. The result is not NUL-terminated; release it with unmap_file.
+ *
+ * \returns 0 on success, 10 if the file cannot be opened, 20 if it cannot
+ *     be read.
+ */
+int map_file(const char *filename, const char **data, size_t *size) {
+#ifdef _WIN32
+  /* No mmap: read it in text mode, like the rest of the program */
+  return read_file(filename, (char **)data, size);
+#else
+  struct stat st;
+  void *map;
+  int fd;
+  if ( ( fd = open(filename, O_RDONLY) ) < 0 ) return 10;
+  if ( fstat(fd, &st) ) { close(fd); return 20; }
+  *size = st.st_size;
+  if ( *size == 0 ) *data = ""; /* mmap rejects empty mappings */
+  else {
+    map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if ( map == MAP_FAILED ) { close(fd); return 20; }
+    *data = map;
+  }
+  close(fd);
+  return 0;
+#endif
+}
+
+void unmap_file(const char *data, size_t size) {
+  if ( !data ) return;
+#ifdef _WIN32
+  free((char *)data);
+#else
+  if ( size > 0 ) munmap((void *)data, size);
+#endif
+}
+
 int load_spec_templates(specopts_t *opts) {
   int i;
   char *filename;
@@ -183,99 +644,165 @@ int load_spec_templates(specopts_t *opts) {
     return 50;
   }
   memset(opts->template, 0, sizeof(opts->template));
-  
+  memset(opts->templatesize, 0, sizeof(opts->templatesize));
+
   for ( i = 0; i < 2; i++ ) {
-    FILE *fh;
+    int rc;
     sprintf(filename, "%s.%s", opts->template_fn, input_suffixes[i]);
 
     /* Load template */
-    if ( ((fh = fopen(filename, "r")) == NULL)) {
-      printf("Failed to open template file: %s\n", strerror(errno));
+    rc = map_file(filename, &opts->template[i], &opts->templatesize[i]);
+    if ( rc ) {
+      printf("Failed to %s template file: %s\n", rc == 10 ? "open" : "read",
+             strerror(errno));
       free(filename);
-      return i+10;
-    }
-    else{
-         printf("Found valid template file %s\n", filename);
-         break; //added else and break so loop ended when proper file found
+      return i+rc;
     }
-    fread(opts->template[i], sizeof(opts->template[i]), 1, fh);
-    if ( ferror(fh) ) {
-      printf("Failed to read template file: %s\n", strerror(errno));
+    if ( compile_template(opts, i) ) {
+      printf("Failed to compile template file %s\n", filename);
       free(filename);
-      return i+20;
+      return i+30;
     }
-    fclose(fh);
   }
   free(filename);
+  if ( find_subfile_inputs(opts) ) {
+    printf("template: Out of memory\n");
+    return 50;
+  }
   return 0;
 }
 
+/* Decoding of the first character of a quantum number field. The value
+ * is qn_tens[c]+qn_sign[c]*digit; qn_sign is 0 for characters that are
+ * not allowed there. */
+static int qn_tens[256];
+static signed char qn_sign[256];
+/* J-weights sqrt(2/(qn[0]+qn[3])) of computed peaks, for the sums of
+ * quantum numbers that SPCAT can print (see jweight) */
+#define JWEIGHT_MAX 720
+static double qn_jweight[JWEIGHT_MAX];
+
+/** Fill in qn_tens and qn_sign. Must be called before any threads start. */
+void init_qn_table(void) {
+  int c;
+  for ( c = 0; c < 256; c++ ) {
+    qn_tens[c] = 0; qn_sign[c] = 0;
+    if ( isspace(c) ) qn_sign[c] = 1;
+    else if ( isdigit(c) ) { qn_tens[c] = 10*(c-'0'); qn_sign[c] = 1; }
+    else if ( c >= 'a' && c <= 'z' ) {
+      qn_tens[c] = -10*(c-'a'+1); qn_sign[c] = -1;
+    }
+    else if ( c >= 'A' && c <= 'Z' ) {
+      qn_tens[c] = 10*(c-'A')+100; qn_sign[c] = 1;
+    }
+    else if ( c == '-' ) qn_sign[c] = -1;
+  }
+  for ( c = 0; c < JWEIGHT_MAX; c++ ) qn_jweight[c] = sqrt(2.0/c);
+}
+
+/** The J-weight of a computed peak whose quantum numbers add up to sum */
+static inline double jweight(int sum) {
+  if ( sum >= 0 && sum < JWEIGHT_MAX ) return qn_jweight[sum];
+  return sqrt(2.0/sum);
+}
+
 /** Parse Quantum Numbers from SPCAT .CAT files (See spinv.pdf, note
  * that documentation incorrectly claims valid range is -259..359)
  *
  * \returns Quantum number in range -269..359, 9999 to denote
  *     overflow ("**"), -9999 to denote parse error.
  */
-int parseqn(const char *str) {
-  int val;
-  //printf("'%s'\n",str);
-  if ( str[0] == '*' || str[1] == '*' ) return 9999; // >359 or <-269
-  if ( !isdigit(str[1]) ) return -9999;
-  val = str[1]-'0';
-  if ( isspace(str[0]) ) ; // Do nothing
-  else if ( isdigit(str[0]) ) val += 10*(str[0]-'0');
-  else if ( isalpha(str[0]) ) {
-    if ( islower(str[0]) ) val = -val-10*(str[0]-'a'+1);
-    else val = val+10*(str[0]-'A')+100;
-  }
-  else if ( str[0] == '-' ) val = -val;
-  else return -9999;
-  return val;
-}
-
-int load_catfile(FILE *fh, datarow **storage, int *size, int *count) {
-/*
-  float a, b, maxb = 0;
-  char trailing[1024];
-*/
-  float maxlgint = 0;
+static inline int parseqn(const char *str) {
+  unsigned char c = str[0];
+  if ( c == '*' || str[1] == '*' ) return 9999; // >359 or <-269
+  if ( str[1] < '0' || str[1] > '9' || !qn_sign[c] ) return -9999;
+  return qn_tens[c]+qn_sign[c]*(str[1]-'0');
+}
+
+/** Parse the fixed-width number in str[0..len), like strtof would.
+ * Plain decimals ("  -7.9345") are converted directly; anything else
+ * (exponents, very long mantissas) is handed to strtof.
+ *
+ * \returns 0 on success, nonzero if strtof reported an error.
+ */
+static int parse_field(const char *str, int len, float *out) {
+  const char *p = str, *end = str+len;
+  unsigned long long mant = 0;
+  int digits = 0, scale = 0, negative = 0;
+  static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+    1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18 };
+
+  while ( p < end && *p == ' ' ) p++;
+  if ( p < end && ( *p == '-' || *p == '+' ) ) negative = ( *p++ == '-' );
+  for ( ; p < end && *p >= '0' && *p <= '9'; p++, digits++ )
+    mant = mant*10+(*p-'0');
+  if ( p < end && *p == '.' )
+    for ( p++; p < end && *p >= '0' && *p <= '9'; p++, digits++, scale++ )
+      mant = mant*10+(*p-'0');
+  if ( digits > 0 && digits <= 15 && ( p == end || *p == ' ' ) ) {
+    /* mant and 10^scale are exact doubles, so this rounds once */
+    double v = (double)mant/pow10[scale];
+    *out = negative ? -v : v;
+    return 0;
+  }
+  else {
+    char buf[32];
+    if ( len >= (int)sizeof(buf) ) len = sizeof(buf)-1;
+    memcpy(buf, str, len);
+    buf[len] = 0;
+    errno = 0;
+    *out = strtof(buf, NULL);
+    return errno;
+  }
+}
+
+/* Column layout of a .CAT line (see spinv.pdf) */
+#define CAT_FREQ   0            /* F13.4 */
+#define CAT_ERR    13           /* F8.4 */
+#define CAT_LGINT  21           /* F8.4 */
+#define CAT_DR     29           /* I2 */
+#define CAT_ELO    31           /* F10.4 */
+#define CAT_GUP    41           /* I3 */
+#define CAT_QNFMT  51           /* I4 */
+#define CAT_QN     55           /* 2x 6I2, then anything */
+
+/** Parse the SPCAT .CAT output in buf[0..len) and append its rows to
+ * *storage (which is grown as necessary), in line order. Lines are decoded
+ * in place by column, without copying or scanning them. Intensities are
+ * left as log10 values; see normalize_intensities.
+ *
+ * \returns 0 on success, 4 on a format error, 5 if out of memory, 6 on
+ *     an invalid quantum number.
+ */
+int parse_catbuf(const char *buf, size_t len, datarow **storage, int *size,
+                 int *count) {
+  const char *p = buf, *end = buf+len;
   int i = 0, j = 0;
   while ( 1 ) {
-    float freq, err, lgint;
-    int qntype = 0;
-    struct {
-      /* This struct stores the split fields of the cat file. */
-      char freq[14], err[9], lgint[9], dr[3], elo[11], gup[4], tag[8],
-           qnfmt[5], qn[128];
-    } s;
-    /* Using a struct makes it very easy to zero out. */
-    memset(&s, 0, sizeof(s));
-
-    if ( !fh ) break; /* Empty memfile wasn't opened */
+    const char *line, *eol;
+    float freq, err, lgint, elo;
+    int qntype = 0, qnlen;
+    datarow *row;
 
     /* Kill newlines characters */
-    fscanf(fh, "%*[\r\n]");
-
-    /* Format of lines of .CAT file is described in spinv.pdf */
-    /* QN is only 24 characters, but also read any extra trailing data. */
-    i = fscanf(fh, "%13c%8c%8c%2c%10c%3c%7c%4c%127[^\r\n]", s.freq, s.err,
-               s.lgint, s.dr, s.elo, s.gup, s.tag, s.qnfmt, s.qn);
-    if ( i == EOF && ferror(fh) ) {
-      printf("Failed to read CAT file: %s\n", strerror(errno));
-      return 3;
-    }
-    else if ( i == EOF ) break;
-    else if ( i != 9 ) {
-      printf("File format error. fscanf: %s\n", strerror(errno));
+    while ( p < end && ( *p == '\r' || *p == '\n' ) ) p++;
+    if ( p >= end ) break;
+    line = p;
+    for ( eol = p; eol < end && *eol != '\r' && *eol != '\n'; eol++ ) ;
+    p = eol;
+
+    /* QN is only 24 characters, but there may be extra trailing data. */
+    if ( eol-line <= CAT_QN ) {
+      printf("File format error: short line\n");
       return 4;
     }
+    qnlen = eol-line-CAT_QN;
 
     /* Convert string values */
-    errno = 0;
-    if ( errno == 0 ) freq  = strtof(s.freq,  NULL);
-    if ( errno == 0 ) err   = strtof(s.err,   NULL);
-    if ( errno == 0 ) lgint = strtof(s.lgint, NULL);
-    if ( errno != 0 ) {
+    if ( parse_field(line+CAT_FREQ,  CAT_ERR-CAT_FREQ,    &freq)  ||
+         parse_field(line+CAT_ERR,   CAT_LGINT-CAT_ERR,   &err)   ||
+         parse_field(line+CAT_LGINT, CAT_DR-CAT_LGINT,    &lgint) ||
+         parse_field(line+CAT_ELO,   CAT_GUP-CAT_ELO,     &elo) ) {
       printf("File format error. strtof: %s\n", strerror(errno));
       return 4;
     }
@@ -290,212 +817,280 @@ int load_catfile(FILE *fh, datarow **storage, int *size, int *count) {
         return 5;
       }
     }
+    row = &(*storage)[*count];
 
     /* Store frequency, intensity values */
-    if ( *count == 0 || lgint > maxlgint ) maxlgint = lgint;
-    (*storage)[*count].frequency = freq;
-    (*storage)[*count].error = err;
-    /* Exponentiation occurs during scaling, below */
-    (*storage)[*count].intensity = lgint;
+    row->frequency = freq;
+    row->error = err;
+    row->elo = elo;
+    /* Exponentiation occurs in normalize_intensities */
+    row->intensity = lgint;
 
     /* Double resonance from trailing data */
     /* Ensure quantum numbers are of type " 303" or "1404" */
-    if ( strcmp(s.qnfmt, "1404") == 0 ) qntype = 4;
-    else if ( strcmp(s.qnfmt, " 303") == 0 ) qntype = 3;
+    if ( memcmp(line+CAT_QNFMT, "1404", 4) == 0 ) qntype = 4;
+    else if ( memcmp(line+CAT_QNFMT, " 303", 4) == 0 ) qntype = 3;
     if ( qntype < 1 || qntype > QN_DIGITS ) {
-      printf("CAT file has unsupported QNFMT '%s'.\n", s.qnfmt);
+      printf("CAT file has unsupported QNFMT '%.4s'.\n", line+CAT_QNFMT);
       return 4;
     }
     for ( i = 0; i < 2; i++ ) {
       for ( j = 0; j < qntype; j++ ) {
-        char str[3]; int val;
-        str[0] = s.qn[12*i+j*2];
-        str[1] = s.qn[12*i+j*2+1];
-        str[2] = 0;
-        val = parseqn(str);
-        //printf("'%s'\n",trailing);
+        int val;
+        if ( 12*i+j*2+1 >= qnlen ) return 6; /* Line too short */
+        val = parseqn(line+CAT_QN+12*i+j*2);
         if ( val == -9999 ) return 6;
-        //printf(" %d", val);
-        (*storage)[*count].qn[i*QN_DIGITS+j] = val;
+        row->qn[i*QN_DIGITS+j] = val;
       }
       /* Fill remaining places with 0. */
-      for ( ; j < QN_DIGITS; j++ ) (*storage)[*count].qn[i*QN_DIGITS+j] = 0;
+      for ( ; j < QN_DIGITS; j++ ) row->qn[i*QN_DIGITS+j] = 0;
     }
-    //printf("\n");
     /* Next item */
     (*count)++;
   }
-  //printf("MAXB %g",maxb);
-  for ( i=0; i < *count; i++ ) {
-    //printf("POW 10^%f => ", (*storage)[i].b);
-    (*storage)[i].intensity = powf(10,(*storage)[i].intensity-maxlgint);
-    //printf("%g\n", (*storage)[i].b);
+  return 0;
+}
+
+/** Convert the log10 intensities of rows[0..count), as parse_catbuf
+ * leaves them, to linear ones relative to the strongest row. A spectrum
+ * assembled from several SPCAT runs is normalized once, as a whole, so
+ * the relative intensities of its components are kept.
+ */
+void normalize_intensities(datarow *rows, int count) {
+  float maxlgint = 0;
+  int i;
+  for ( i = 0; i < count; i++ )
+    if ( i == 0 || rows[i].intensity > maxlgint )
+      maxlgint = rows[i].intensity;
+  for ( i = 0; i < count; i++ )
+    rows[i].intensity = powf(10, rows[i].intensity-maxlgint);
+}
+
+static uint64_t obsblob_checksum(const char *p, size_t len) {
+  uint64_t h = 14695981039346656037ull; /* FNV-1a */
+  while ( len-- ) h = ( h^(unsigned char)*p++ )*1099511628211ull;
+  return h;
+}
+
+/** Size of a compiled histogram of nbins bins, with its header */
+static inline size_t obsblob_hist_size(uint32_t nbins) {
+  return sizeof(obsblob_hist)+OBSBLOB_ALIGN(nbins*(sizeof(double)+sizeof(int)));
+}
+
+/** Use the compiled observation in buf[0..len) for ob. Its rows are used
+ * where they are, so buf must stay mapped until ob is freed.
+ *
+ * \returns 0 on success, 17 if it was written by another version or
+ *     machine, 18 if it is corrupt.
+ */
+static int load_observation_blob(spec_observation *ob, const char *buf,
+                                 size_t len) {
+  const obsblob_header *hdr = (const obsblob_header *)buf;
+  size_t pos = sizeof(obsblob_header);
+  unsigned int k;
+  if ( hdr->version != OBSBLOB_VERSION || hdr->rowsize != sizeof(datarow) ) {
+    printf("Compiled observation %s is from another version\n", ob->file);
+    return 17;
+  }
+  if ( hdr->checksum != obsblob_checksum(buf+pos, len-pos) ) {
+    printf("Compiled observation %s is corrupt (checksum)\n", ob->file);
+    return 18;
+  }
+  pos += OBSBLOB_ALIGN((size_t)hdr->count*sizeof(datarow));
+  for ( k = 0; k < hdr->nhist && pos+sizeof(obsblob_hist) <= len; k++ )
+    pos += obsblob_hist_size(((const obsblob_hist *)(buf+pos))->nbins);
+  if ( k < hdr->nhist || pos > len ) {
+    printf("Compiled observation %s is corrupt (size)\n", ob->file);
+    return 18;
   }
+  ob->blob = hdr;
+  ob->blobsize = len;
+  ob->rows = (datarow *)(buf+sizeof(obsblob_header));
+  ob->size = ob->count = hdr->count;
   return 0;
 }
 
-int load_spec_observation(specopts_t *opts) {
-  FILE *fh;
+/** Load ob->file, either an SPCAT .cat file or a compiled observation
+ * (see compile_observation). Windows builds read files in text mode, so
+ * they can't load compiled observations.
+ *
+ * \returns 0 on success, 12 if the file cannot be read, 14-16 if it cannot
+ *     be parsed (see parse_catbuf), 17-18 if it is an unusable compiled
+ *     observation (see load_observation_blob).
+ */
+int load_spec_observation(spec_observation *ob) {
+  const char *buf;
+  size_t len;
   int rc = 0;
-  if ( ( fh = fopen(opts->obsfile, "r") ) == NULL ) {
-    printf("Failed to open observation file: %s\n", strerror(errno));
+  init_qn_table();
+  if ( ( rc = map_file(ob->file, &buf, &len) ) != 0 ) {
+    printf("Failed to %s observation file: %s\n", rc == 10 ? "open" : "read",
+           strerror(errno));
     return 12;
   }
-  rc = load_catfile(fh, &(opts->observation), &(opts->observationsize),
-                    &(opts->observationcount));
+  if ( len >= sizeof(obsblob_header) &&
+       memcmp(buf, OBSBLOB_MAGIC, sizeof(OBSBLOB_MAGIC)) == 0 ) {
+    if ( ( rc = load_observation_blob(ob, buf, len) ) != 0 )
+      unmap_file(buf, len);
+    return rc;
+  }
+  rc = parse_catbuf(buf, len, &(ob->rows), &(ob->size), &(ob->count));
   if ( rc > 0 ) rc += 10;
-  fclose(fh);
+  else normalize_intensities(ob->rows, ob->count);
+  unmap_file(buf, len);
+  return rc;
+}
+
+/** Make room for len more bytes (plus a terminating NUL) in rb. */
+static int render_reserve(render_buffer *rb, size_t len) {
+  if ( rb->len+len+1 > rb->size ) {
+    size_t size = rb->size ? rb->size*2 : 4096;
+    char *buf;
+    while ( size < rb->len+len+1 ) size *= 2;
+    if ( ( buf = realloc(rb->buf, size) ) == NULL ) return -1;
+    rb->buf = buf;
+    rb->size = size;
+  }
   return 0;
 }
 
-#ifdef USE_SPCAT_OBJ
-#error Not updated for new template format
-int generate_input_buffers(specopts_t *opts, char *buffers[],
-                           size_t bufsizes[], GA_segment *x) {
-  int i;
+static int render_append(render_buffer *rb, const char *s, size_t len) {
+  if ( render_reserve(rb, len) ) return -1;
+  memcpy(rb->buf+rb->len, s, len);
+  rb->len += len;
+  return 0;
+}
+
+/** Append [-]v followed by the 4-character exponent suffix exp. */
+static int render_number(render_buffer *rb, int negative, GA_segment v,
+                         const char *exp) {
+  char digits[24], *p = digits+sizeof(digits);
+  size_t n;
+  do { *--p = '0'+v%10; v /= 10; } while ( v );
+  if ( negative ) *--p = '-';
+  n = digits+sizeof(digits)-p;
+  if ( render_reserve(rb, n+4) ) return -1;
+  memcpy(rb->buf+rb->len, p, n);
+  memcpy(rb->buf+rb->len+n, exp, 4);
+  rb->len += n+4;
+  return 0;
+}
+
+/** Render subfile number subfile of input template i (see input_suffixes)
+ * for individual x into rb, replacing its contents. rb->buf is always
+ * NUL-terminated on success.
+ *
+ * \returns 1 if the template has another subfile after this one, 0 if this
+ *     was the last one, or -1 on error.
+ */
+int render_template(specopts_t *opts, unsigned int generation, int i,
+                    GA_segment *x, unsigned int subfile, render_buffer *rb) {
+  const compiled_template *ct = &opts->compiled[i];
+  const GA_segment zero =
+    ~((GA_segment)1<<(GA_segment_size-1)); // (0xfff...fff)/2
+  const template_subfile *sf;
+  unsigned int k;
+  int rc = 0;
+  rb->len = 0;
+  if ( render_reserve(rb, 0) ) return -1;
+  rb->buf[0] = 0;
+  if ( subfile >= ct->nsubfiles ) return 0;
+  sf = &ct->subfiles[subfile];
+  for ( k = 0; k < sf->nspans && rc == 0; k++ ) {
+    const template_span *sp = &sf->spans[k];
+    GA_segment v;
+    switch ( sp->type ) {
+    case TSPAN_TEXT:
+      rc = render_append(rb, sp->text, sp->len);
+      break;
+    case TSPAN_G:
+      rc = render_number(rb, 0, x[sp->index], "E-05");
+      break;
+    case TSPAN_GSUM:
+      rc = render_number(rb, 0, (x[sp->index]+x[sp->index+1])/2, "E-05");
+      break;
+    case TSPAN_GDIFF:
+      rc = render_number(rb, 0, (x[sp->index-1]-x[sp->index])/2, "E-05");
+      break;
+    case TSPAN_GZERO:
+      /* Handle zero point */
+      v = x[sp->index];
+      rc = render_number(rb, v > zero, (v > zero) ? (v-zero) : (zero-v),
+                         "E-12");
+      break;
+    case TSPAN_E:
+      if ( opts->initialerror[sp->index] && opts->errordecay != 0 ) {
+        char buf[32];
+        int n = snprintf(buf, sizeof(buf), "%g",
+                         1e-5*powf(opts->errordecay, generation)*
+                         opts->initialerror[sp->index]);
+        rc = render_append(rb, buf, n);
+      }
+      else rc = render_append(rb, "0", 1);
+      break;
+    }
+  }
+  if ( rc ) {
+    printf("template: Out of memory\n");
+    return -1;
+  }
+  rb->buf[rb->len] = 0;
+  return subfile+1 < ct->nsubfiles;
+}
+
+/** Render the SPCAT input files for subfile number subfile into rb[0]
+ * (.int) and rb[1] (.var).
+ *
+ * \returns The next subfile to process, 0 if this was the last one, or a
+ *     negative number on error.
+ */
+int generate_input_buffers(specopts_t *opts, unsigned int generation,
+                           render_buffer rb[2], GA_segment *x,
+                           unsigned int subfile) {
+  int i, rc = 0;
   for ( i = 0; i < 2; i++ ) {
-    bufsizes[i] = asprintf(&buffers[i], opts->template[i], x[0], x[1], x[2]);
-    if ( bufsizes[i] < 0 ) return i+1;
+    rc = render_template(opts, generation, i, x, subfile, &rb[i]);
+    if ( rc < 0 ) return -(2*subfile+i+1);
   }
-  return 0;
+  /* The .var template decides whether another subfile follows. */
+  return rc ? subfile+1 : 0;
 }
-#else
+
+/** Render the SPCAT input files basename.int and basename.var for subfile
+ * number subfile, using rb as scratch space.
+ *
+ * \returns The next subfile to process, 0 if this was the last one, or a
+ *     negative number on error.
+ */
 int generate_input_files(specopts_t *opts, unsigned int generation,
-                         char *basename, GA_segment *x, unsigned int subfile) {
+                         char *basename, GA_segment *x, unsigned int subfile,
+                         render_buffer rb[2]) {
   char filename[128];
-  int i;
+  int i, rc;
+  rc = generate_input_buffers(opts, generation, rb, x, subfile);
+  if ( rc < 0 ) return rc;
   /* Output data files */
   for ( i = 0; i < 2; i++ ) {
     int retval = -(2*subfile+i+1); /* FIXME: Include sub-inputfile? */
-    char *tmpl = opts->template[i];
     FILE *fh;
-    int oldj = 0, j = 0, parsemode = 0, nrecord = 0;
     snprintf(filename, sizeof(filename), "%s.%s", basename,
              input_suffixes[i]);
     if ( ( fh = fopen(filename, "w") ) == NULL ) {
       printf("Failed to open input file: %s\n", strerror(errno));
       return retval;
     }
-    for ( j = 0; /* None, uses break */; j++ ) {
-      char c = tmpl[j];
-      if ( ( c == '%' ) || ( c == '$' ) || ( c == 0 ) ) {
-        int nitems = j-oldj;
-        if ( parsemode == 0 ) {
-          /* Write the data out directly */
-          if ( nitems && nrecord == subfile ) {
-            size_t rc = fwrite(tmpl+oldj, 1, nitems, fh);
-            if ( rc != nitems ) {
-              printf("template: Write failed (tried to write %d, rc=%d)\n",
-                     nitems, rc);
-              return retval;
-            }
-          }
-          if ( c == '$' ) {
-            /* Delete up to end of line, including end-of-line characters. */
-            int hadnewline = 0;
-            while ( tmpl[j+1] != 0 && tmpl[j+1] != '$' ) {
-              if ( tmpl[j] == '\r' || tmpl[j] == '\n' ) hadnewline = 1;
-              if ( !hadnewline || tmpl[j+1] == '\r' || tmpl[j+1] == '\n' ) j++;
-              else break;
-            }
-            /* $$ for literal $ */
-            if ( tmpl[j+1] == '$' ) {
-              c = 1; /* Dummy value that's not 0 and not $ */
-              j++;
-              if ( nrecord == subfile && fputc('$', fh) == EOF ) {
-                printf("template: Write failed (tried to write $, got error)\n");
-                return retval;
-              }
-            }
-            parsemode = 0;
-          }
-          else parsemode = c;
-        }
-        else if ( parsemode == '%' ) {
-          /* Parse the data as an escape */
-          if ( nrecord != subfile ) { /* Don't write anything yet */ }
-          else if ( nitems <= 0 ) {
-            /* %% means a plain % sign */
-            if ( fputc('%', fh) == EOF ) {
-              printf("template: Write failed (tried to write %%, got error)\n");
-              return retval;
-            }
-          }
-          else {
-            /* Named escape, extract it */
-            char escape[8], type;
-            int index = 0, modindex = 0;
-            memset(escape, 0, sizeof(escape));
-            if ( nitems > 7 || nitems < 1 ) {
-              printf("template: Named escape is too long or too short\n");
-              return retval;
-            }
-            strncpy(escape, tmpl+oldj, nitems);
-            index = atoi(escape+1);
-            modindex = index % SEGMENTS;
-            type = escape[0];
-            if ( type == 'g' ) {
-              /* Render field properly in exp-notation */
-              if ( modindex == 0 ) /* A */
-                fprintf(fh, "%uE-05", x[index]);
-              else if ( modindex == 1 ) /* B */
-                fprintf(fh, "%uE-05", opts->linkbc?((x[index]+x[index+1])/2):
-                                                   x[index]);
-              else if ( modindex == 2 ) /* C */
-                fprintf(fh, "%uE-05", opts->linkbc?((x[index-1]-x[index])/2):
-                                                   x[index]);
-              else if ( modindex < SEGMENTS ) { /* DJ, DJK, DK, delJ, delK */
-                /* Handle zero point */
-                GA_segment v = x[index];
-                const int zero = ~(1<<(GA_segment_size-1)); // (0xfff...fff)/2
-                fprintf(fh, "%s%uE-12", (v > zero) ? "-" : "",
-                        (v > zero) ? (v-zero) : (zero-v));
-              }
-              else {
-                printf("template: Index too large %d\n", index);
-                return retval;
-              }
-              /* FIXME: Error checking for fprintf? */
-            }
-            else if ( type == 'e' ) {
-              /* FIXME: Error handling within gaspec */
-              if ( opts->initialerror[index] && opts->errordecay != 0 ) {
-                fprintf(fh, "%g", 1e-5*powf(opts->errordecay, generation)*
-                                  opts->initialerror[index]);
-              }
-              else fprintf(fh, "0");
-            }
-            else {
-              printf("template: Unknown escape type %c\n", type);
-              return retval;
-            }
-          }
-          parsemode = 0;
-        }
-        oldj = j+1;
-        if ( c == 0 ) { /* End of template. Next subfile is first one. */
-          if ( i == 1 ) subfile = 0;
-          break;
-        }
-        if ( c == '$' ) {
-          /* End of subfile. If not got correct subfile, proceed onwards.
-             Otherwise, return, indicating another subfile available. */
-          if ( nrecord < subfile ) nrecord++;
-          else {
-            if ( i == 1 ) subfile++;
-            break;
-          }
-        }
-      }
+    if ( fwrite(rb[i].buf, 1, rb[i].len, fh) != rb[i].len ) {
+      printf("Failed to write input file: %s\n", strerror(errno));
+      fclose(fh);
+      return retval;
     }
     if ( fclose(fh) ) {
       printf("Failed to close input file: %s\n", strerror(errno));
       return retval;
     }
   }
-  return subfile;
+  return rc;
 }
-#endif /* unless USE_SPCAT_OBJ */
 
 /* getline is a GNU extension. It reads a line of text, malloc/reallocing the
  * output buffer as necessary. Implement it using fgets. */
@@ -523,21 +1118,87 @@ void realloc_specopts_range(specopts_t *so, int newrs) {
   int i = 0, oldsize = SEGMENTS*so->rangesize, newsize = SEGMENTS*newrs;
   if ( newrs <= so->rangesize ) return;
   so->rangesize = newrs;
-  if ( !(so->userange = realloc(so->userange, sizeof(void *)*newsize)) )
+  if ( !(so->userange = realloc(so->userange,
+                                sizeof(*so->userange)*newsize)) )
     { printf("Out of memory (specopts.userange)\n"); exit(1); }
-  if ( !(so->rangetemp = realloc(so->rangetemp, sizeof(void *)*newsize)) )
+  if ( !(so->rangetemp = realloc(so->rangetemp,
+                                 sizeof(*so->rangetemp)*newsize)) )
     { printf("Out of memory (specopts.rangetemp)\n"); exit(1); }
-  if ( !(so->rangemin = realloc(so->rangemin, sizeof(void *)*newsize)) )
+  if ( !(so->rangemin = realloc(so->rangemin, sizeof(GA_segment)*newsize)) )
     { printf("Out of memory (specopts.rangemin)\n"); exit(1); }
-  if ( !(so->rangemax = realloc(so->rangemax, sizeof(void *)*newsize)) )
+  if ( !(so->rangemax = realloc(so->rangemax, sizeof(GA_segment)*newsize)) )
     { printf("Out of memory (specopts.rangemax)\n"); exit(1); }
-  if ( !(so->initialerror = realloc(so->initialerror, sizeof(void *)*newsize)) )
+  if ( !(so->initialerror = realloc(so->initialerror,
+                                    sizeof(GA_segment)*newsize)) )
     { printf("Out of memory (specopts.initialerror)\n"); exit(1); }
   for ( i = oldsize; i < newsize; i++ ) /* Initialize new fields */
     so->userange[i] = so->rangetemp[i] = so->rangemin[i] =
       so->rangemax[i] = so->initialerror[i] = 0;
 }
 
+/** Add an observed spectrum (--match) with default settings. */
+void add_observation(specopts_t *so, char *file) {
+  spec_observation *ob;
+  if ( !(so->obs = realloc(so->obs, sizeof(spec_observation)*(so->nobs+1))) )
+    { printf("Out of memory (specopts.obs)\n"); exit(1); }
+  ob = &so->obs[so->nobs++];
+  memset(ob, 0, sizeof(spec_observation));
+  ob->file = file;
+  ob->weight = 1;
+}
+
+/** The observation that a --match-* option applies to: the last one. */
+spec_observation *last_observation(specopts_t *so, const char *option) {
+  if ( so->nobs == 0 ) {
+    printf("--%s must follow the --match it applies to\n", option);
+    exit(1);
+  }
+  return &so->obs[so->nobs-1];
+}
+
+/** Parse the value of a segment range option. Values that don't fit in a
+ * GA_segment are rejected rather than silently truncated. */
+GA_segment parse_range_value(const char *arg) {
+  const GA_segment max = (GA_segment)~(GA_segment)0;
+  unsigned long long v;
+  char *end = NULL;
+  errno = 0;
+  while ( isspace((unsigned char)*arg) ) arg++;
+  v = strtoull(arg, &end, 10);
+  if ( *arg == '-' || end == arg || *end || errno == ERANGE || v > max ) {
+    printf("Invalid range value %s (must be 0 to %" GA_PRIu ")\n", arg, max);
+    exit(1);
+  }
+  return (GA_segment)v;
+}
+
+/** Choose the frequencies that the integrated SPCAT writes lines for: the
+ * observed range and the double resonance peaks, with some room for the
+ * rounding of the frequencies SPCAT writes. Nothing else is looked at,
+ * but all lines are kept with --match-temp, which scales intensities
+ * relative to the strongest line after rescaling, wherever that is.
+ */
+void set_spcat_window(specopts_t *so) {
+  unsigned int i, k;
+  int j;
+  so->spcatwinmin = so->spcatwinmax = 0;
+  for ( k = 0; k < so->nobs; k++ )
+    if ( so->obs[k].temperature != 0 ) return;
+  so->spcatwinmin = so->obsrangemin;
+  so->spcatwinmax = so->obsrangemax;
+  for ( i = 0; i < so->doublereslen; i++ ) {
+    for ( j = 0; j < so->doubleres[i].npeaks; j++ ) {
+      double peak = so->doubleres[i].peaks[j];
+      if ( peak-so->doublerestol < so->spcatwinmin )
+        so->spcatwinmin = peak-so->doublerestol;
+      if ( peak+so->doublerestol > so->spcatwinmax )
+        so->spcatwinmax = peak+so->doublerestol;
+    }
+  }
+  so->spcatwinmin -= 1;
+  so->spcatwinmax += 1;
+}
+
 int my_parseopt(const struct option *long_options, GA_settings *settings,
                 int c, int option_index) {
   switch (c) {
@@ -547,9 +1208,17 @@ int my_parseopt(const struct option *long_options, GA_settings *settings,
   case 't':
     ((specopts_t *)settings->ref)->template_fn = optarg;
     break;
-  case 'm':
-    ((specopts_t *)settings->ref)->obsfile = optarg;
+  case 'm': {
+    specopts_t *so = (specopts_t *)settings->ref;
+    /* The first --match on the command line replaces those of the
+     * configuration file */
+    if ( settings->optsource == 'A' && !so->argsmatch ) {
+      so->argsmatch = 1;
+      so->nobs = 0;
+    }
+    add_observation(so, optarg);
     break;
+  }
   case 'S':
     ((specopts_t *)settings->ref)->spcatbin = optarg;
     break;
@@ -576,7 +1245,7 @@ int my_parseopt(const struct option *long_options, GA_settings *settings,
       so->userange[i]++;
       count = so->userange[i];
       realloc_specopts_range(so, count);
-      so->rangemin[i+(count-1)*SEGMENTS] = atoi(optarg);
+      so->rangemin[i+(count-1)*SEGMENTS] = parse_range_value(optarg);
       for ( j = 0; j < count; j++ ) so->userange[i+j*SEGMENTS] = count;
     }
     break;
@@ -594,7 +1263,7 @@ int my_parseopt(const struct option *long_options, GA_settings *settings,
       so->rangetemp[i]++;
       count = so->rangetemp[i];
       realloc_specopts_range(so, count);
-      so->rangemax[i+(count-1)*SEGMENTS] = atoi(optarg);
+      so->rangemax[i+(count-1)*SEGMENTS] = parse_range_value(optarg);
       for ( j = 0; j < count; j++ ) so->rangetemp[i+j*SEGMENTS] = count;
     }
     break;
@@ -657,6 +1326,50 @@ int my_parseopt(const struct option *long_options, GA_settings *settings,
   case 59: /* cooperative-mode */
     ((specopts_t *)settings->ref)->componentcount = atoi(optarg);
     break;
+  case 60: /* spcat-pool */
+#ifdef _WIN32
+    printf("--spcat-pool is not supported on Windows\n");
+    exit(1);
+#endif
+    ((specopts_t *)settings->ref)->spcatpool = 1;
+    break;
+  case 61: /* spectrum-cache */
+    ((specopts_t *)settings->ref)->speccachemb = atoi(optarg);
+    break;
+  case 62: /* match-weight */
+    last_observation(settings->ref, "match-weight")->weight = atof(optarg);
+    break;
+  case 64: /* match-temp (not 63, which is '?' to getopt) */
+    last_observation(settings->ref, "match-temp")->temperature = atof(optarg);
+    break;
+  case 65: /* match-bins */
+    last_observation(settings->ref, "match-bins")->bins = atoi(optarg);
+    break;
+  case 66: /* early-exit */
+    ((specopts_t *)settings->ref)->earlyexit = atof(optarg);
+    break;
+  case 67: /* prune-blocks */
+    ((specopts_t *)settings->ref)->pruneblocks = 1;
+    break;
+  case 70: /* compile-observation (68 and 69 are -D and -E) */
+    ((specopts_t *)settings->ref)->compileobs = optarg;
+    break;
+  case 71: /* binary-protocol */
+#ifndef CLIENT_ONLY
+    settings->distbinary = 1;
+#endif
+    break;
+  case 72: /* hybrid */
+#ifndef CLIENT_ONLY
+    settings->disthybrid = 1;
+    settings->distbinary = 1;
+#endif
+    break;
+  case 73: /* remote-deadline */
+#ifndef CLIENT_ONLY
+    settings->distdeadline = atof(optarg);
+#endif
+    break;
   default:
     printf("Aborting: %c\n",c);
     abort ();
@@ -664,36 +1377,232 @@ int my_parseopt(const struct option *long_options, GA_settings *settings,
   return 0;
 }
 
-int main(int argc, char *argv[]) {
-  GA_settings settings;
-  specopts_t specopts;
-  time_t starttime = time(NULL); /* To compute runtime */
-  int rc = 0;
-  int i;
-  /* After updating usage comments, run generate-usage.pl on this file
-   * to update usage message header files.
-   */
-  static const struct option my_long_options[] = {
-    /** -o, --output FILE
-     *
-     * Use FILE.{cat,int,out,var} for temporary and output storage.
-     * (default is random name of the form "tmp-gaspec-XXX")
-     */
-    {"output",   required_argument, 0, 'o'},
-    /** -t, --template FILE
-     *
-     * Use FILE.{int,var} as a template to generate SPCAT input.
-     * (default "template") */
-    {"template", required_argument, 0, 't'},
-    /** -m, --match FILE
-     *
+#ifdef CLIENT_ONLY
+/** One item of a workunit */
+struct GAC_individual {
+  unsigned int index;
+  int done;                     /* Fitness is known */
+  GA_individual indiv;
+};
+/** A result read back from the output file of an interrupted run */
+typedef struct { unsigned int index; double fitness; } client_result;
+
+/** The items of a workunit, shared by the reader and the evaluator
+ * threads. Items are added as they are read and written out in order
+ * as soon as they (and the ones before them) are done. */
+typedef struct {
+  GA_session *ga;
+  struct GAC_individual **pop;  /* Items read so far, NULL once written */
+  unsigned int popsize, allocated;
+  unsigned int next;            /* First item no thread has taken */
+  unsigned int written;         /* First item not written yet */
+  int eof;                      /* All items have been read */
+  FILE *outfile;
+#if THREADS
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;          /* Signalled when an item is added, or EOF */
+#endif
+} client_queue;
+
+/** Parse an "I index segment..." line into a new item.
+ *
+ * \returns The item, or NULL if line is not an item.
+ */
+struct GAC_individual *client_parse_item(const char *line,
+                                         unsigned int nsegments) {
+  struct GAC_individual *item;
+  unsigned int index, offset, i;
+  const char *subline = line;
+  if ( sscanf(line, "I %u%n", &index, &offset) < 1 ) return NULL;
+  item = calloc(1, sizeof(struct GAC_individual));
+  if ( item ) item->indiv.gdsegments = malloc(sizeof(GA_segment)*nsegments);
+  if ( !item || !item->indiv.gdsegments ) {
+    printf("malloc failed while loading population.\n");
+    exit(1);
+  }
+  item->index = index;
+  for ( i = 0; i < nsegments; i++ ) {
+    subline += offset;
+    if ( sscanf(subline, "%" GA_SCNx "%n", &(item->indiv.gdsegments[i]),
+                &offset) < 1 ) {
+      printf("Item parse failure: %s", line);
+      exit(1);
+    }
+  }
+  return item;
+}
+
+/** Add item to q. Must hold the lock. */
+void client_add_item(client_queue *q, struct GAC_individual *item) {
+  if ( q->popsize >= q->allocated ) {
+    q->allocated = (q->allocated+1)*2;
+    q->pop = realloc(q->pop, q->allocated*sizeof(struct GAC_individual *));
+    if ( !q->pop ) {
+      printf("malloc failed while loading population.\n");
+      exit(1);
+    }
+  }
+  q->pop[q->popsize++] = item;
+}
+
+/** Write out the results that are next in order, and free their items.
+ * Must hold the lock. */
+void client_write_results(client_queue *q) {
+  while ( q->written < q->popsize && q->pop[q->written]->done ) {
+    struct GAC_individual *item = q->pop[q->written];
+    printf("F %04d %f E\n", item->index, item->indiv.fitness);
+    fflush(stdout);
+    fprintf(q->outfile, "F %04d %f E\n", item->index, item->indiv.fitness);
+    fflush(q->outfile);
+    free(item->indiv.gdsegments);
+    free(item);
+    q->pop[q->written++] = NULL;
+  }
+}
+
+/** Evaluate item, which no other thread is looking at */
+void client_evaluate_item(client_queue *q, void *thbuf,
+                          struct GAC_individual *item) {
+  int rc;
+  printf("Evaluating %u\n", item->index);
+  rc = GA_fitness(q->ga, thbuf, &(item->indiv));
+  if ( rc != 0 ) {
+    printf("Fitness of item %u returned error %d\n", item->index, rc);
+    exit(1);
+  }
+}
+
+#if THREADS
+/** Evaluator thread (client -T): evaluate items as they are added, until
+ * all have been read and taken. */
+void *client_evaluate(void *arg) {
+  client_queue *q = (client_queue *)arg;
+  GA_thread thread;
+  int rc;
+  thread.session = q->ga;
+  thread.ref = NULL;
+  if ( (rc = GA_thread_init(&thread)) != 0 ) {
+    printf("GA_thread_init failed: %d\n", rc);
+    exit(1);
+  }
+  pthread_mutex_lock(&q->mutex);
+  while ( 1 ) {
+    struct GAC_individual *item;
+    while ( q->next >= q->popsize && !q->eof )
+      pthread_cond_wait(&q->cond, &q->mutex);
+    if ( q->next >= q->popsize ) break;
+    item = q->pop[q->next++];
+    if ( !item || item->done ) continue; /* Resumed from the output file */
+    pthread_mutex_unlock(&q->mutex);
+    client_evaluate_item(q, thread.ref, item);
+    pthread_mutex_lock(&q->mutex);
+    item->done = 1;
+    client_write_results(q);
+  }
+  pthread_mutex_unlock(&q->mutex);
+  GA_thread_free(&thread);
+  return NULL;
+}
+#endif
+
+/** Number of processors to use for client -T auto */
+static unsigned int client_cpu_count(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if ( n > 0 ) return (unsigned int)n;
+#endif
+  return 1;
+}
+#endif /* CLIENT_ONLY */
+
+int main(int argc, char *argv[]) {
+  GA_settings settings;
+  specopts_t specopts;
+  time_t starttime = time(NULL); /* To compute runtime */
+  int rc = 0;
+  int i;
+  /* After updating usage comments, run generate-usage.pl on this file
+   * to update usage message header files.
+   */
+  static const struct option my_long_options[] = {
+    /** -o, --output FILE
+     *
+     * Use FILE.{cat,int,out,var} for temporary and output storage.
+     * (default is random name of the form "tmp-gaspec-XXX")
+     */
+    {"output",   required_argument, 0, 'o'},
+    /** -t, --template FILE
+     *
+     * Use FILE.{int,var} as a template to generate SPCAT input.
+     * (default "template") */
+    {"template", required_argument, 0, 't'},
+    /** -m, --match FILE
+     *
      * Match against FILE, formatted as an SPCAT .cat file.  (default
-     * "isopropanol.cat")
+     * "isopropanol.cat") May be given more than once to fit several
+     * spectra at the same time; each individual is still only run through
+     * SPCAT once, and the fitness is the weighted sum of the scores.
+     * --match on the command line replaces any given in the configuration
+     * file (-c), along with their --match-* options.
      */
     {"match",    required_argument, 0, 'm'},
+    /** --match-weight WEIGHT
+     *
+     * Weight of the score against the preceding --match file (default 1)
+     */
+    {"match-weight", required_argument, 0, 62},
+    /** --match-temp KELVIN
+     *
+     * Rescale computed intensities from the template's temperature (TEMP in
+     * the .int) to KELVIN before comparing against the preceding --match
+     * file. (default 0, use the template's temperature)
+     */
+    {"match-temp", required_argument, 0, 64},
+    /** --match-bins NUMBER
+     *
+     * Always use NUMBER bins for the preceding --match file, instead of
+     * --bins, --binscale or --random-bins.
+     */
+    {"match-bins", required_argument, 0, 65},
+    /** --compile-observation FILE
+     *
+     * Parse the --match file, bin it for the bin counts that --bins,
+     * --binscale and --match-bins give, write the result to FILE and exit.
+     * FILE can then be given to --match (also on distributed clients) and
+     * loads without parsing or binning. It can only be read on machines
+     * like the one that wrote it, and its bins are only used with the
+     * same --rangemin and --rangemax.
+     */
+    {"compile-observation", required_argument, 0, 70},
+    /** --early-exit FRACTION
+     *
+     * Score each new individual against the FRACTION of bins with the most
+     * observed intensity first (e.g. 0.1), then against each --match in
+     * turn. As soon as a partial score shows it to be less fit than the
+     * elites of the previous generation, skip the rest of the scoring and
+     * use that partial score as its fitness. Individuals that could only
+     * be chosen by roulette then get a somewhat better fitness than they
+     * would otherwise have. The double resonance check is always done.
+     * Requires --weight between 0 and 1, and --match-weight not less than
+     * 0. Not used with --binscale, --random-bins or --errordecay, which
+     * change the elites' scores from one generation to the next.
+     */
+    {"early-exit", required_argument, 0, 66},
+    /** --prune-blocks
+     *
+     * Have SPCAT skip the intensity calculation for pairs of energy blocks
+     * whose transitions all fall outside the frequencies that are scored
+     * (--rangemin to --rangemax, and the --drfile peaks). Intensities are
+     * then relative to the strongest line SPCAT did compute, which may be
+     * weaker than the strongest line of the whole spectrum. Only used by
+     * builds with the integrated SPCAT (USE_SPCAT_OBJ), and not with
+     * --match-temp.
+     */
+    {"prune-blocks",     no_argument, 0, 67},
     /** -S, --spcat FILE
      *
-     * SPCAT program file. (default "./spcat") */
+     * SPCAT program file. (default "./spcat") Ignored by builds with the
+     * integrated SPCAT (USE_SPCAT_OBJ), which never run an external program. */
     {"spcat",    required_argument, 0, 'S'},
     /** -b, --bins NUMBER
      *
@@ -852,9 +1761,35 @@ int main(int argc, char *argv[]) {
      * Use DISTRIBUTOR for distributed computation.
      */
     {"distributed", required_argument, 0, 43},
+    /** --binary-protocol
+     *
+     * Send individuals to the --distributed DISTRIBUTOR, and read their
+     * fitness back, in binary frames instead of text lines. Individuals are
+     * sent in batches, and results may come back in any order and in
+     * batches. The distributor must support it (gaspecdist.pl and the
+     * stand-in distributor/localdist.pl do).
+     */
+    {"binary-protocol",  no_argument, 0, 71},
+    /** --hybrid
+     *
+     * With --distributed, also evaluate individuals locally with --threads
+     * threads, while one more thread sends the rest of each generation to
+     * the DISTRIBUTOR. The population is split by how fast the local
+     * threads and the distributor have been. Implies --binary-protocol.
+     */
+    {"hybrid",           no_argument, 0, 72},
+    /** --remote-deadline SECONDS
+     *
+     * With --hybrid, individuals that the distributor has not returned
+     * after SECONDS are also evaluated locally, and the first result is
+     * used. By default, the deadline is twice the time the distributor is
+     * expected to take.
+     */
+    {"remote-deadline",  required_argument, 0, 73},
     /** --tempdir DIR
      *
-     * Use DIR for temporary files.
+     * Use DIR for temporary files. (Unused with the integrated SPCAT or
+     * --spcat-pool.)
      */
     {"tempdir",    required_argument, 0, 44},
     /** --compress METHOD
@@ -883,11 +1818,33 @@ int main(int argc, char *argv[]) {
      * Number of components to fit
      */
     {"components", required_argument, 0, 59},
+    /** --spcat-pool
+     *
+     * Start one SPCAT server process per thread and keep it running,
+     * sending it each evaluation's input over a pipe, instead of running
+     * SPCAT once per evaluation. Keeps SPCAT out of process (a crash only
+     * loses that server, which is restarted) without the cost of starting
+     * it every time. The --spcat program must be the spcat built in
+     * spcat-obj, which accepts --server. Not supported on Windows.
+     */
+    {"spcat-pool",       no_argument, 0, 60},
+    /** --spectrum-cache MB
+     *
+     * Keep up to MB megabytes of recent SPCAT output, so individuals that
+     * are evaluated again (elites, duplicates) are only rebinned and
+     * rescored. Output is cached per template subfile ('$'), so with
+     * several --components in separate subfiles only the subfiles whose
+     * parameters changed are run again; a template of one subfile is
+     * cached as a whole. Unlike the fitness cache, this also works with
+     * --random-bins and --binscale, but not with --errordecay.
+     */
+    {"spectrum-cache", required_argument, 0, 61},
     {0, 0, 0, 0}
   };
 #ifdef CLIENT_ONLY
   FILE *config;
   unsigned int generation = 0;
+  unsigned int nthreads = 1;    /* -T */
 #else
   char *my_optstring = "o:t:m:b:S:w:P:";
   char *optlog = malloc(128);   /* Initial allocation */
@@ -904,7 +1861,9 @@ int main(int argc, char *argv[]) {
   settings.ref = &specopts;
   specopts.basename_out = NULL;
   specopts.template_fn = "template-404";
-  specopts.obsfile = "isopropanol-404.cat";
+  specopts.obs = NULL;
+  specopts.nobs = 0;
+  specopts.argsmatch = 0;
 #ifdef _WIN32
   specopts.spcatbin = "./spcat.exe";
 #else
@@ -914,8 +1873,8 @@ int main(int argc, char *argv[]) {
   specopts.bins = BINS;
   specopts.distanceweight = 1.0;
   /* These are resized during option parsing */
-  specopts.userange = specopts.rangetemp = specopts.rangemin =
-    specopts.rangemax = specopts.initialerror = NULL;
+  specopts.userange = specopts.rangetemp = NULL;
+  specopts.rangemin = specopts.rangemax = specopts.initialerror = NULL;
   specopts.rangesize = 0;
   realloc_specopts_range(&specopts, 1); /* Initialize to one component */
   specopts.errordecay = 0;
@@ -932,14 +1891,36 @@ int main(int argc, char *argv[]) {
   specopts.distributor = NULL;
   specopts.compress = 0;
   specopts.componentcount = 1;
+  specopts.spcatpool = 0;
+  specopts.speccache = NULL;
+  specopts.speccachemb = 0;
+  specopts.earlyexit = 0;
+  specopts.spcatwinmin = specopts.spcatwinmax = 0;
+  specopts.pruneblocks = 0;
+  specopts.compileobs = NULL;
+  specopts.subfileinputs = NULL;
+  specopts.nsubfileinputs = 0;
 
 #ifdef CLIENT_ONLY
-  if ( argc != 3 ) {
-    printf("Usage: %s <configfile> <outfile>\nChecksum: %s\n",
-           argv[0], CHECKSUM);
+  if ( argc == 5 && strcmp(argv[1], "-T") == 0 ) {
+    if ( strcmp(argv[2], "auto") == 0 ) nthreads = client_cpu_count();
+    else nthreads = atoi(argv[2]);
+    argv += 2; argc -= 2;
+  }
+  if ( argc != 3 || nthreads < 1 ) {
+    printf("Usage: %s [-T threads|auto] <configfile|-> <outfile>\n"
+           "Checksum: %s%s\n", argv[0], CHECKSUM, SEGMENT_TAG);
     exit(1);
   }
-  if ( ( config = fopen(argv[1], "r") ) == NULL ) {
+#if !THREADS
+  if ( nthreads > 1 ) {
+    printf("Built without threads, ignoring -T\n");
+    nthreads = 1;
+  }
+#endif
+  /* "-" reads the workunit from stdin, e.g. a pipe or socket */
+  if ( strcmp(argv[1], "-") == 0 ) config = stdin;
+  else if ( ( config = fopen(argv[1], "r") ) == NULL ) {
     printf("Could not open config file %s: %s\n", argv[1], strerror(errno));
     exit(1);
   }
@@ -947,9 +1928,12 @@ int main(int argc, char *argv[]) {
     char *line = NULL; size_t linelen = 0;
     char key[512], value[4096];
     while ( my_getline(&line, &linelen, config) > 0 ) {
-      int rc = sscanf(line, "CFG%*c %511s%*[ \t]%4095[^\r\n]", key, value);
+      char source;
+      int rc = sscanf(line, "CFG%c %511s%*[ \t]%4095[^\r\n]", &source,
+                      key, value)-1;
       /* Handle this command-line argument */
       if ( rc == 1 || rc == 2 ) {
+        settings.optsource = source; /* As GA_getopt would */
         //printf("FIXME arg %d '%s' '%s'\n",rc, key, value);
         for ( i = 0; my_long_options[i].name != 0; i++ ) {
           if ( strcmp(key, my_long_options[i].name) != 0 ) continue;
@@ -978,7 +1962,8 @@ int main(int argc, char *argv[]) {
     if ( strcmp(key, "ANY") == 0 ) {
       printf("Warning: Ignoring version from configuration.\n");
     }
-    else if ( strcmp(key, CHECKSUM) != 0 ) {
+    else if ( strncmp(key, CHECKSUM, strlen(CHECKSUM)) != 0 ||
+              strcmp(key+strlen(CHECKSUM), SEGMENT_TAG) != 0 ) {
       printf("Configuration version %s is incorrect.\n", key);
       exit(1);
     }
@@ -1016,6 +2001,44 @@ int main(int argc, char *argv[]) {
     /* Do not enable caching if error decays */
     settings.usecaching = 0;
   }
+  if ( specopts.earlyexit != 0 ) {
+    /* Partial scores are only bounds if no term can be negative */
+    for ( i = 0; i < specopts.nobs && specopts.obs[i].weight >= 0; i++ ) ;
+    if ( !(specopts.earlyexit > 0) ) {
+      qprintf(&settings, "Not using --early-exit: FRACTION must be "
+              "greater than 0\n");
+      specopts.earlyexit = 0;
+    }
+    else if ( i < specopts.nobs || specopts.distanceweight < 0 ||
+              specopts.distanceweight > 1 ) {
+      qprintf(&settings, "Not using --early-exit with negative weights\n");
+      specopts.earlyexit = 0;
+    }
+    else if ( specopts.binscale != 0 || specopts.randbins != 0 ||
+              specopts.errordecay != 0 ) {
+      /* The elites' fitness, the threshold, is from the last generation */
+      qprintf(&settings, "Not using --early-exit with --binscale, "
+              "--random-bins or --errordecay\n");
+      specopts.earlyexit = 0;
+    }
+    else if ( specopts.earlyexit > 1 ) specopts.earlyexit = 1;
+  }
+  if ( specopts.speccachemb && specopts.errordecay != 0 )
+    qprintf(&settings, "Not using --spectrum-cache with --errordecay\n");
+  else if ( specopts.speccachemb ) {
+    specopts.speccache =
+      spectrum_cache_new((size_t)specopts.speccachemb*1024*1024);
+    if ( !specopts.speccache ) {
+      printf("Could not create spectrum cache: %s\n", strerror(errno));
+      exit(1);
+    }
+  }
+
+  if ( specopts.compileobs ) {
+    if ( specopts.nobs == 0 ) add_observation(&specopts, "isopropanol-404.cat");
+    exit(compile_observation(&specopts, settings.generations,
+                             specopts.compileobs));
+  }
 
   /* Connect to distributor */
   if ( specopts.distributor ) {
@@ -1064,8 +2087,16 @@ int main(int argc, char *argv[]) {
       printf("Could not open socket handle: %s\n", strerror(errno));
       exit(1);
     }
-    fprintf(settings.distributor, "%s\nV %s\n", optlog+1, CHECKSUM);
-    settings.threadcount = 1;
+    fprintf(settings.distributor, "%s\nV %s%s\n", optlog+1, CHECKSUM,
+            SEGMENT_TAG);
+    if ( settings.distbinary )
+      fprintf(settings.distributor, "BINARY %d\n", GA_DIST_VERSION);
+    /* One thread talks to the distributor; in hybrid mode, the others
+     * evaluate locally */
+    if ( settings.disthybrid )
+      settings.threadcount = ( settings.threadcount > 0 ?
+                               settings.threadcount : 1 ) + 1;
+    else settings.threadcount = 1;
   }
 #endif /* not CLIENT_ONLY */
 
@@ -1076,10 +2107,8 @@ int main(int argc, char *argv[]) {
   }
   realloc_specopts_range(&specopts, specopts.componentcount);
 
-  /* Initialize observation storage */
-  specopts.observation = NULL;
-  specopts.observationsize = 0;
-  specopts.observationcount = 0;
+  /* Default observation */
+  if ( specopts.nobs == 0 ) add_observation(&specopts, "isopropanol-404.cat");
 
 #ifdef CLIENT_ONLY
   specopts.basename_out = strdup(argv[2]);
@@ -1193,6 +2222,8 @@ int main(int argc, char *argv[]) {
       exit(1);
     }
   }
+  /* A dead SPCAT server shows up as a write error, not a signal. */
+  if ( specopts.spcatpool ) signal(SIGPIPE, SIG_IGN);
 #endif
 #ifndef CLIENT_ONLY
   lprintf(&settings, "%s\n", optlog+1); free(optlog);
@@ -1206,11 +2237,30 @@ int main(int argc, char *argv[]) {
     qprintf(&settings, "load_spec_templates failed: %d\n", rc);
     return rc;
   }
-  /* Load observed data file */
-  lprintf(&settings, "Loading observation file %s\n", specopts.obsfile);
-  if ( (rc = load_spec_observation(&specopts)) != 0 ) {
-    qprintf(&settings, "load_spec_observation failed: %d\n", rc);
-    return rc;
+  /* Load observed data files */
+  for ( i = 0; i < specopts.nobs; i++ ) {
+    spec_observation *ob = &specopts.obs[i];
+    unsigned int k;
+    lprintf(&settings, "Loading observation file %s\n", ob->file);
+    if ( (rc = load_spec_observation(ob)) != 0 ) {
+      qprintf(&settings, "load_spec_observation failed: %d\n", rc);
+      return rc;
+    }
+    if ( ob->temperature < 0 ) {
+      qprintf(&settings, "--match-temp must not be negative\n");
+      return 1;
+    }
+    if ( ob->weight != 1 || ob->temperature != 0 || ob->bins != 0 )
+      lprintf(&settings, "  weight %g, temperature %g K, %u bins\n",
+              ob->weight, ob->temperature, ob->bins);
+    /* Rescaling needs the temperature SPCAT computed intensities at */
+    for ( k = 0; ob->temperature != 0 &&
+                 k < specopts.compiled[0].nsubfiles; k++ ) {
+      if ( specopts.subfileinputs[k].temperature > 0 ) continue;
+      qprintf(&settings, "--match-temp: Cannot read TEMP from subfile %u of "
+              "%s.int\n", k, specopts.template_fn);
+      return 1;
+    }
   }
 #ifndef CLIENT_ONLY
   /* Load starting population */
@@ -1230,7 +2280,7 @@ int main(int argc, char *argv[]) {
       int rc = fscanf(fh, "%*d %*d GD");
       if ( rc == 0 ) {
         for ( i = 0; i < specopts.componentcount*SEGMENTS; i++ ) {
-          rc = fscanf(fh, "%u", &specopts.popdata[idx*specopts.componentcount*
+          rc = fscanf(fh, "%" GA_SCNu, &specopts.popdata[idx*specopts.componentcount*
                                                   SEGMENTS+i]);
           if ( rc != 1 ) break;
         }
@@ -1304,6 +2354,7 @@ int main(int argc, char *argv[]) {
     }
     fclose(fh);
   }
+  set_spcat_window(&specopts);
 
   lprintf(&settings, "Using %d bins\n", specopts.bins);
 
@@ -1314,75 +2365,46 @@ int main(int argc, char *argv[]) {
             specopts.rangesize, specopts.componentcount);
 
 #ifdef CLIENT_ONLY
-  /* Do something */
+  /* Evaluate the items as they are read, so that a client fed through a
+   * pipe or socket starts before the whole workunit has arrived. */
   {
-    struct GAC_individual { unsigned int index; GA_individual indiv; }
-      *pop = NULL;
-    unsigned int popsize = 0, ncompleted = 0, pos = 0;
-    /* Load from/save to the output file */
-    char *line = NULL; size_t linelen = 0; FILE *outfile;
+    client_queue q;
+    client_result *resume = NULL;
+    unsigned int nresume = 0, resumesize = 0;
+    char *line = NULL; size_t linelen = 0;
+    FILE *outfile;
     /* Initialize GA objects */
     GA_session ga;
     GA_thread thread;
+#if THREADS
+    pthread_t *threads = NULL;
+#endif
     ga.settings = &settings;
     ga.generation = generation;
+    ga.threshold = -HUGE_VAL;   /* No --early-exit without the population */
     thread.session = &ga;
     thread.ref = NULL;
-    rc = GA_thread_init(&thread);
-    if ( rc != 0 ) {
+    if ( nthreads == 1 && ( rc = GA_thread_init(&thread) ) != 0 ) {
       printf("GA_thread_init failed: %d", rc);
       exit(1);
     }
-    /* Load population from config file */
-    while ( my_getline(&line, &linelen, config) > 0 ) {
-      unsigned int index, offset; char *subline = line;
-      int rc = sscanf(line, "I %u%n", &index, &offset);
-      /* Handle this item */
-      if ( rc < 1 ) {
-        printf("Not an item: %s", line);
-        continue;
-      }
-      /* Grow allocation if necessary */
-      if ( pos >= popsize ) {
-        popsize = (popsize+1)*2;
-        pop = realloc(pop, popsize*sizeof(struct GAC_individual));
-        if ( !pop ) {
-          printf("malloc failed while loading population.\n");
-          exit(1);
-        }
-      }
-      /* Prepare individual structure */
-      memset(&(pop[pos]), 0, sizeof(struct GAC_individual));
-      pop[pos].index = index;
-      pop[pos].indiv.gdsegments = malloc(sizeof(GA_segment)*
-                                         specopts.componentcount*SEGMENTS);
-      /* Load segments */
-      for ( i = 0; i < specopts.componentcount*SEGMENTS; i++ ) {
-        subline += offset;
-        rc = sscanf(subline, "%x%n", &(pop[pos].indiv.gdsegments[i]), &offset);
-        if ( rc < 1 ) {
-          printf("Item parse failure: %s", line);
-          exit(1);
-        }
-      }
-      pos++;
-    }
-    popsize = pos;
-    /* Load state from output file */
+    /* Load results from the output file of an interrupted run */
     if ( ( outfile = fopen(specopts.basename_out, "r") ) != NULL ) {
       while ( my_getline(&line, &linelen, outfile) > 0 ) {
-        char linecheck[4]; unsigned int index;
+        char linecheck[4]; client_result r;
         /* Try to read a line from the file */
-        if ( ( sscanf(line, "F %u %lf %1s", &index,
-                      &(pop[ncompleted].indiv.fitness), linecheck) != 3 ) ||
+        if ( ( sscanf(line, "F %u %lf %1s", &r.index, &r.fitness,
+                      linecheck) != 3 ) ||
               ( strcmp(linecheck, "E") != 0 ) ) break;
-        if ( index != pop[ncompleted].index ) {
-          printf("Output file (%u) does not match config (%u) at line %u\n",
-                 index, pop[ncompleted].index, ncompleted+1);
-          ncompleted = 0; /* Don't trust the data */
-          break;
+        if ( nresume >= resumesize ) {
+          resumesize = (resumesize+1)*2;
+          resume = realloc(resume, resumesize*sizeof(client_result));
+          if ( !resume ) {
+            printf("malloc failed while loading output file.\n");
+            exit(1);
+          }
         }
-        ncompleted++;
+        resume[nresume++] = r;
       }
       fclose(outfile);
     }
@@ -1397,25 +2419,80 @@ int main(int argc, char *argv[]) {
       printf("Could not start generation, rc=%d\n", rc);
       exit(1);
     }
-    /* Start read loop */
-    for ( pos = 0; pos < popsize; pos++ ) {
-      if ( pos >= ncompleted ) {
-        printf("Evaluating %u\n", pop[pos].index);
-        rc = GA_fitness(&ga, thread.ref, &(pop[pos].indiv));
-        if ( rc != 0 ) {
-          printf("Fitness of item %u returned error %d\n", pop[pos].index, rc);
+    memset(&q, 0, sizeof(q));
+    q.ga = &ga;
+    q.outfile = outfile;
+#if THREADS
+    if ( nthreads > 1 ) {
+      pthread_mutex_init(&q.mutex, NULL);
+      pthread_cond_init(&q.cond, NULL);
+      if ( !( threads = malloc(sizeof(pthread_t)*nthreads) ) ) {
+        printf("Out of memory (client threads)\n");
+        exit(1);
+      }
+      for ( i = 0; i < nthreads; i++ ) {
+        if ( ( rc = pthread_create(&threads[i], NULL, client_evaluate,
+                                   &q) ) != 0 ) {
+          printf("pthread_create failed: %s\n", strerror(rc));
           exit(1);
         }
       }
-      printf("F %04d %f E\n", pop[pos].index, pop[pos].indiv.fitness);
-      fflush(stdout);
-      fprintf(outfile, "F %04d %f E\n",
-              pop[pos].index, pop[pos].indiv.fitness);
-      fflush(outfile);
     }
-    GA_thread_free(&thread);
+#endif
+    /* Read the items, and hand them to the evaluator */
+    while ( my_getline(&line, &linelen, config) > 0 ) {
+      struct GAC_individual *item =
+        client_parse_item(line, specopts.componentcount*SEGMENTS);
+      if ( !item ) {
+        printf("Not an item: %s", line);
+        continue;
+      }
+      if ( q.popsize < nresume ) {
+        if ( resume[q.popsize].index == item->index ) {
+          item->indiv.fitness = resume[q.popsize].fitness;
+          item->done = 1;
+        }
+        else {
+          printf("Output file (%u) does not match config (%u) at line %u\n",
+                 resume[q.popsize].index, item->index, q.popsize+1);
+          nresume = 0; /* Don't trust the rest */
+        }
+      }
+#if THREADS
+      if ( nthreads > 1 ) {
+        pthread_mutex_lock(&q.mutex);
+        client_add_item(&q, item);
+        client_write_results(&q);
+        pthread_cond_signal(&q.cond);
+        pthread_mutex_unlock(&q.mutex);
+        continue;
+      }
+#endif
+      client_add_item(&q, item);
+      if ( !item->done ) {
+        client_evaluate_item(&q, thread.ref, item);
+        item->done = 1;
+      }
+      client_write_results(&q);
+    }
+#if THREADS
+    if ( nthreads > 1 ) {
+      pthread_mutex_lock(&q.mutex);
+      q.eof = 1;
+      pthread_cond_broadcast(&q.cond);
+      pthread_mutex_unlock(&q.mutex);
+      for ( i = 0; i < nthreads; i++ ) pthread_join(threads[i], NULL);
+      pthread_mutex_destroy(&q.mutex);
+      pthread_cond_destroy(&q.cond);
+      free(threads);
+    }
+#endif
+    if ( nthreads == 1 ) GA_thread_free(&thread);
+    fclose(outfile);
+    if ( config != stdin ) fclose(config);
     free(line);
-    free(pop);
+    free(resume);
+    free(q.pop);
   }
 
   qprintf(&settings, "Finished.\nTook %u seconds\n", time(NULL)-starttime);
@@ -1448,8 +2525,26 @@ int main(int argc, char *argv[]) {
   }
 #endif
   free(specopts.basename_out);
-  free(specopts.observation);
+  if ( specopts.speccache ) {
+    lprintf(&settings, "Spectrum cache: %lu hits, %lu misses\n",
+            specopts.speccache->hits, specopts.speccache->misses);
+    spectrum_cache_free(specopts.speccache);
+  }
+  for ( i = 0; i < specopts.nobs; i++ ) {
+    if ( specopts.obs[i].blob )
+      unmap_file((const char *)specopts.obs[i].blob, specopts.obs[i].blobsize);
+    else free(specopts.obs[i].rows);
+    free(specopts.obs[i].obsbin);
+    free(specopts.obs[i].obsbincount);
+    free(specopts.obs[i].strong);
+  }
+  free(specopts.obs);
   free(specopts.doubleres);
+  free_subfile_inputs(&specopts);
+  for ( i = 0; i < 2; i++ ) {
+    free_template(&specopts.compiled[i]);
+    unmap_file(specopts.template[i], specopts.templatesize[i]);
+  }
   rc = 0;
   /* TODO: Free more memory */
   /* Remove temporary files */
@@ -1463,14 +2558,23 @@ GA_segment GA_random_segment(GA_session *ga, const unsigned int i,
                              const unsigned int j) {
   specopts_t *opts = (specopts_t *)ga->settings->ref;
   GA_segment r = GA_rand(ga);
+#if GA_segment_size > 32
+  r = (r << 32) ^ GA_rand(ga);
+#endif
   if ( opts->popfile ) {
     // Note that the random state will be completely different.
     r = grayencode(opts->popdata[i*opts->componentcount*SEGMENTS+j]);
   }
   else if ( opts->userange[j] ) {
-    unsigned int realr;
+    GA_segment realr;
+#if GA_segment_size > 32
+    /* A double cannot hold every value of a wide range, so stay integral */
+    GA_segment span = opts->rangemax[j]-opts->rangemin[j];
+    realr = (span+1 ? r % (span+1) : r)+opts->rangemin[j];
+#else
     realr = (unsigned)((double)(r)*(opts->rangemax[j]-opts->rangemin[j])
                        /RAND_MAX)+opts->rangemin[j];
+#endif
     r = grayencode(realr);
     //printf("%03d %u < %u < %u\n",i,opts->rangemin[j],realr,opts->rangemax[j]);
   }
@@ -1484,6 +2588,8 @@ int GA_finished_generation(const GA_session *ga, int terminating) {
   int rc = 0;
   FILE *fh;
   char filename[128];
+  render_buffer rb[2];
+  memset(rb, 0, sizeof(rb));
   snprintf(filename, sizeof(filename), "%s.pop", opts->basename_out);
   if ( ( fh = fopen(filename, "w") ) == NULL ) {
     qprintf(ga->settings, "Failed to open pop output file: %s\n",
@@ -1495,12 +2601,13 @@ int GA_finished_generation(const GA_session *ga, int terminating) {
     int j = 0;
     fprintf(fh, "%04u %04u GD", ga->generation, p);
     for ( j = 0; j < ga->population[p].segmentcount; j++ )
-      fprintf(fh, "  %10u", x[j]);
+      fprintf(fh, "  %10" GA_PRIu, x[j]);
     fprintf(fh, "\n");
     if ( p == ga->fittest ) {
       /* Generate SPCAT input file */
       rc = generate_input_files(opts, ga->generation, opts->basename_out, x,
-                                0 /* Assume one subfile */);
+                                0 /* Assume one subfile */, rb);
+      free(rb[0].buf); free(rb[1].buf);
       if ( rc < 0 ) {
         qprintf(ga->settings,
                 "finished_generation generate_input_files failed: %d\n", rc);
@@ -1548,6 +2655,49 @@ int GA_fitness_quick(const GA_session *ga, GA_individual *elem) {
   return 1;
 }
 
+/* Clamp v to [lo, hi]. If the interval is empty, return lo (the caller's
+ * GA_fitness_quick will still reject the individual). */
+static GA_segment clamp_segment(GA_segment v, GA_segment lo, GA_segment hi) {
+  if ( v < lo || lo > hi ) return lo;
+  if ( v > hi ) return hi;
+  return v;
+}
+
+int GA_repair(const GA_session *ga, GA_individual *elem) {
+  specopts_t *opts = (specopts_t *)ga->settings->ref;
+  GA_segment *x = elem->gdsegments;
+  GA_segment lo[SEGMENTS], hi[SEGMENTS];
+  int i, j, modified = 0;
+
+  for ( i = 0; i < elem->segmentcount; i += SEGMENTS ) {
+    GA_segment old[SEGMENTS];
+    /* Clamp every segment to its range */
+    for ( j = 0; j < SEGMENTS; j++ ) {
+      old[j] = x[i+j];
+      lo[j] = opts->userange[i+j] ? opts->rangemin[i+j] : 0;
+      hi[j] = opts->userange[i+j] ? opts->rangemax[i+j] : (GA_segment)-1;
+      x[i+j] = clamp_segment(x[i+j], lo[j], hi[j]);
+    }
+    /* Enforce A >= B >= C > 0 within the ranges. With linkbc, the
+     * segments are B+C and B-C, so only the ranges are enforced. */
+    if ( !opts->linkbc ) {
+      if ( x[i+1] > x[i+0] ) {
+        if ( lo[1] <= x[i+0] ) x[i+1] = x[i+0];
+        else x[i+0] = clamp_segment(x[i+1] = lo[1], lo[0], hi[0]);
+      }
+      x[i+2] = clamp_segment(x[i+2], lo[2] > 0 ? lo[2] : 1,
+                             hi[2] < x[i+1] ? hi[2] : x[i+1]);
+    }
+    /* Keep the Gray-coded segments in sync */
+    for ( j = 0; j < SEGMENTS; j++ ) {
+      if ( x[i+j] == old[j] ) continue;
+      elem->segments[i+j] = grayencode(x[i+j]);
+      modified = 1;
+    }
+  }
+  return modified;
+}
+
 int GA_termination(const GA_session *ga) {
   if ( ga->population[ga->fittest].unscaledfitness > -0.00001 )
     return 1;
@@ -1555,6 +2705,200 @@ int GA_termination(const GA_session *ga) {
 }
 #endif /* not CLIENT_ONLY */
 
+typedef struct { unsigned int index; double total; } sortable_bin;
+
+int bin_comparator(const void *a, const void *b) {
+  sortable_bin x = *(sortable_bin *)a, y = *(sortable_bin *)b;
+  if ( x.total < y.total ) return 1;
+  else if ( x.total > y.total ) return -1;
+  else return 0; /* x-y; */     /* If equal sort by index to preserve order */
+}
+
+/** The number of bins to use for observation ob */
+static inline unsigned int observation_bins(const specopts_t *opts,
+                                            const spec_observation *ob) {
+  return ob->bins ? ob->bins : opts->scaledbins;
+}
+
+/** Add up the intensities and the number of the rows of ob in each of
+ * nbins bins between --rangemin and --rangemax. obsbin and obsbincount
+ * must be zeroed.
+ */
+static void bin_rows(const specopts_t *opts, const spec_observation *ob,
+                     int nbins, double *obsbin, int *obsbincount) {
+  const double binsize = ((double)(opts->obsrangemax-opts->obsrangemin))/nbins;
+  int i;
+  for ( i = 0; i < ob->count; i++ ) {
+    const datarow *entry = &ob->rows[i];
+    if ( ( entry->frequency < opts->obsrangemin ) ||
+         ( entry->frequency > opts->obsrangemax ) )
+      continue;
+    /* We're within the valid range */
+    int bin = floor((entry->frequency-opts->obsrangemin)/binsize);
+    if ( bin >= nbins ) bin = nbins-1;
+    obsbin[bin] += entry->intensity;
+    obsbincount[bin]++;
+  }
+}
+
+/** The histogram of nbins bins compiled into ob, or NULL if there is none
+ * for this number of bins and frequency range. */
+static const obsblob_hist *find_histogram(const specopts_t *opts,
+                                          const spec_observation *ob,
+                                          int nbins) {
+  const char *p;
+  unsigned int k;
+  if ( !ob->blob || ob->blob->rangemin != opts->obsrangemin ||
+       ob->blob->rangemax != opts->obsrangemax ) return NULL;
+  p = (const char *)ob->blob+sizeof(obsblob_header)+
+    OBSBLOB_ALIGN((size_t)ob->count*sizeof(datarow));
+  for ( k = 0; k < ob->blob->nhist; k++ ) {
+    const obsblob_hist *h = (const obsblob_hist *)p;
+    if ( h->nbins == (uint32_t)nbins ) return h;
+    p += obsblob_hist_size(h->nbins);
+  }
+  return NULL;
+}
+
+/** Bin each observed spectrum into observation_bins bins, unless that has
+ * already been done. Called between generations, so GA_fitness can share
+ * the result between threads without locking. With --early-exit, also
+ * find the bins with the most intensity.
+ *
+ * \returns 0 on success, nonzero if out of memory.
+ */
+int bin_observation(specopts_t *opts) {
+  unsigned int k;
+  for ( k = 0; k < opts->nobs; k++ ) {
+    spec_observation *ob = &opts->obs[k];
+    const int nbins = observation_bins(opts, ob);
+    const obsblob_hist *hist;
+    if ( ob->obsbin && ob->nbins == nbins ) continue;
+    free(ob->obsbin); free(ob->obsbincount);
+    ob->nbins = 0;
+    ob->obsbin = calloc(nbins, sizeof(double));
+    ob->obsbincount = calloc(nbins, sizeof(int));
+    if ( !ob->obsbin || !ob->obsbincount ) {
+      free(ob->obsbin); free(ob->obsbincount);
+      ob->obsbin = NULL; ob->obsbincount = NULL;
+      return 1;
+    }
+    if ( ( hist = find_histogram(opts, ob, nbins) ) != NULL ) {
+      const double *bins = (const double *)(hist+1);
+      memcpy(ob->obsbin, bins, sizeof(double)*nbins);
+      memcpy(ob->obsbincount, bins+nbins, sizeof(int)*nbins);
+    }
+    else bin_rows(opts, ob, nbins, ob->obsbin, ob->obsbincount);
+    ob->nbins = nbins;
+    free(ob->strong);
+    ob->strong = NULL;
+    ob->nstrong = 0;
+#ifndef CLIENT_ONLY
+    /* Clients don't exit early (their threshold is -HUGE_VAL), and get
+     * --early-exit as given rather than as checked in main */
+    if ( opts->earlyexit > 0 ) {
+      sortable_bin *order = malloc(sizeof(sortable_bin)*nbins);
+      int i;
+      ob->nstrong = ceil(opts->earlyexit*nbins);
+      if ( ob->nstrong > nbins ) ob->nstrong = nbins;
+      ob->strong = malloc(sizeof(int)*ob->nstrong);
+      if ( !order || !ob->strong ) {
+        free(order);
+        ob->nstrong = 0;
+        return 1;
+      }
+      for ( i = 0; i < nbins; i++ ) {
+        order[i].index = i;
+        order[i].total = ob->obsbin[i];
+      }
+      qsort(order, nbins, sizeof(sortable_bin), bin_comparator);
+      for ( i = 0; i < ob->nstrong; i++ ) ob->strong[i] = order[i].index;
+      free(order);
+    }
+#endif
+  }
+  return 0;
+}
+
+#ifndef CLIENT_ONLY
+/** Add nbins to the first *n entries of counts, unless it is there */
+static void add_bin_count(unsigned int *counts, unsigned int *n, long nbins) {
+  unsigned int k;
+  if ( nbins < 1 || *n >= OBSBLOB_MAXHIST ) return;
+  for ( k = 0; k < *n; k++ ) if ( counts[k] == nbins ) return;
+  counts[(*n)++] = nbins;
+}
+
+/** Load the (single) --match file and write it to filename as a compiled
+ * observation, along with histograms for the bin counts the options give
+ * (--match-bins, or --bins and the counts --binscale steps through over
+ * generations generations). --random-bins counts are binned as usual.
+ *
+ * \returns 0 on success, nonzero on error.
+ */
+int compile_observation(specopts_t *opts, unsigned int generations,
+                        const char *filename) {
+  spec_observation *ob;
+  obsblob_header *hdr;
+  unsigned int counts[OBSBLOB_MAXHIST], n = 0, g, k;
+  size_t size, pos;
+  char *blob;
+  FILE *fh;
+  int rc;
+  if ( opts->nobs != 1 ) {
+    printf("--compile-observation compiles one --match file\n");
+    return 1;
+  }
+  ob = &opts->obs[0];
+  if ( (rc = load_spec_observation(ob)) != 0 ) {
+    printf("load_spec_observation failed: %d\n", rc);
+    return rc;
+  }
+  if ( ob->bins ) add_bin_count(counts, &n, ob->bins);
+  else {
+    for ( g = 0; g <= ( opts->binscale != 0 ? generations : 0 ); g++ )
+      add_bin_count(counts, &n, (unsigned int)(opts->bins+g*opts->binscale));
+  }
+
+  size = pos = sizeof(obsblob_header)+
+    OBSBLOB_ALIGN((size_t)ob->count*sizeof(datarow));
+  for ( k = 0; k < n; k++ ) size += obsblob_hist_size(counts[k]);
+  if ( ( blob = calloc(1, size) ) == NULL ) {
+    printf("Out of memory (compiled observation)\n");
+    return 1;
+  }
+  hdr = (obsblob_header *)blob;
+  memcpy(hdr->magic, OBSBLOB_MAGIC, sizeof(OBSBLOB_MAGIC));
+  hdr->version = OBSBLOB_VERSION;
+  hdr->rowsize = sizeof(datarow);
+  hdr->count = ob->count;
+  hdr->nhist = n;
+  hdr->rangemin = opts->obsrangemin;
+  hdr->rangemax = opts->obsrangemax;
+  memcpy(blob+sizeof(obsblob_header), ob->rows, sizeof(datarow)*ob->count);
+  for ( k = 0; k < n; k++ ) {
+    obsblob_hist *h = (obsblob_hist *)(blob+pos);
+    double *bins = (double *)(h+1);
+    h->nbins = counts[k];
+    bin_rows(opts, ob, counts[k], bins, (int *)(bins+counts[k]));
+    pos += obsblob_hist_size(counts[k]);
+  }
+  hdr->checksum = obsblob_checksum(blob+sizeof(obsblob_header),
+                                   size-sizeof(obsblob_header));
+
+  if ( ( fh = fopen(filename, "wb") ) == NULL ||
+       fwrite(blob, 1, size, fh) != size || fclose(fh) ) {
+    printf("Failed to write %s: %s\n", filename, strerror(errno));
+    free(blob);
+    return 1;
+  }
+  free(blob);
+  printf("Compiled %d rows of %s, binned %u ways, into %s\n", ob->count,
+         ob->file, n, filename);
+  return 0;
+}
+#endif /* not CLIENT_ONLY */
+
 int GA_starting_generation(GA_session *ga) {
   specopts_t *opts = (specopts_t *)ga->settings->ref;
   /* Update bin size */
@@ -1571,46 +2915,258 @@ int GA_starting_generation(GA_session *ga) {
     qprintf(ga->settings, "Now using %d bins\n", opts->scaledbins);
 #ifndef CLIENT_ONLY
     if ( ga->settings->distributor )
-      fprintf(ga->settings->distributor, "CFGS bins %u\nV %s\n",
-              opts->scaledbins, CHECKSUM);
+      GA_distributor_printf(ga->settings, "CFGS bins %u\nV %s%s\n",
+                            opts->scaledbins, CHECKSUM, SEGMENT_TAG);
 #endif
   }
+  if ( bin_observation(opts) ) {
+    qprintf(ga->settings, "Out of memory binning observation\n");
+    return 1;
+  }
   return 0;
 }
 
-typedef struct { unsigned int index; double total; } sortable_bin;
+/* Double resonance lookups. Each evaluation's computed peaks are sorted
+ * by frequency so the ones near a resonance can be found by binary
+ * search, and the QN tuples in drlist are hashed so the peaks' quantum
+ * numbers can be found without scanning the list. */
 
-int bin_comparator(const void *a, const void *b) {
-  sortable_bin x = *(sortable_bin *)a, y = *(sortable_bin *)b;
-  if ( x.total < y.total ) return 1;
-  else if ( x.total > y.total ) return -1;
-  else return 0; /* x-y; */     /* If equal sort by index to preserve order */
+int dr_peak_comparator(const void *a, const void *b) {
+  const dr_peak *x = (const dr_peak *)a, *y = (const dr_peak *)b;
+  if ( x->frequency < y->frequency ) return -1;
+  else if ( x->frequency > y->frequency ) return 1;
+  else return x->index-y->index;
 }
 
+int int_comparator(const void *a, const void *b) {
+  return *(const int *)a-*(const int *)b;
+}
 
-int peak_error_comparator(const void *a, const void *b) {
-  datarow *x = (datarow *)a, *y = (datarow *)b;
-  if ( x->error < y->error ) return -1;
-  else if ( x->error > y->error ) return 1;
-  else return 0; /* x-y; */     /* If equal sort by index to preserve order */
+unsigned int qn_hash(const int *qn) {
+  unsigned int h = 2166136261u;         /* FNV-1a */
+  int i;
+  for ( i = 0; i < QN_DIGITS; i++ ) h = ( h^(unsigned int)qn[i] )*16777619u;
+  return h;
 }
 
-int GA_fitness(const GA_session *ga, void *thbuf, GA_individual *elem) {
+/** Add the quantum numbers of thrs->drlist[l] to the hash chains. */
+void dr_hash_entry(specthreadopts_t *thrs, int l) {
+  int n;
+  for ( n = 0; n < QN_COUNT; n++ ) {
+    int slot = l*QN_COUNT+n;
+    unsigned int h = qn_hash(&thrs->drlist[l].qn[n*QN_DIGITS]) &
+      (thrs->drhashsize-1);
+    thrs->drnext[slot] = thrs->drhead[h];
+    thrs->drhead[h] = slot;
+  }
+}
+
+/** Make room in thrs->drlist for more than drlen entries, keeping the first
+ * drlen (and rehashing them if the hash table grows).
+ *
+ * \returns 0 on success.
+ */
+int dr_grow_list(specthreadopts_t *thrs, int drlen) {
+  int size = (thrs->drsize+1)*2, l;
+  unsigned int hashsize = thrs->drhashsize ? thrs->drhashsize : 64;
+  dblres_check *list;
+  int *next, *head;
+  while ( hashsize < 2*QN_COUNT*(unsigned int)size ) hashsize *= 2;
+  if ( ( list = realloc(thrs->drlist, sizeof(dblres_check)*size) ) == NULL )
+    return 1;
+  thrs->drlist = list;
+  if ( ( next = realloc(thrs->drnext, sizeof(int)*QN_COUNT*size) ) == NULL )
+    return 1;
+  thrs->drnext = next;
+  thrs->drsize = size;
+  if ( hashsize != thrs->drhashsize ) {
+    if ( ( head = realloc(thrs->drhead, sizeof(int)*hashsize) ) == NULL )
+      return 1;
+    thrs->drhead = head;
+    thrs->drhashsize = hashsize;
+    memset(thrs->drhead, 0xff, sizeof(int)*hashsize);
+    for ( l = 0; l < drlen; l++ ) dr_hash_entry(thrs, l);
+  }
+  return 0;
+}
+
+/** Build the frequency index of thrs->compdata. \returns 0 on success. */
+int dr_index_peaks(specthreadopts_t *thrs) {
+  int k;
+  if ( thrs->drordersize < thrs->compdatacount ) {
+    dr_peak *order = realloc(thrs->drorder,
+                             sizeof(dr_peak)*thrs->compdatacount);
+    int *near = realloc(thrs->drnear, sizeof(int)*thrs->compdatacount);
+    if ( order ) thrs->drorder = order;
+    if ( near ) thrs->drnear = near;
+    if ( !order || !near ) return 1;
+    thrs->drordersize = thrs->compdatacount;
+  }
+  for ( k = 0; k < thrs->compdatacount; k++ ) {
+    thrs->drorder[k].frequency = thrs->compdata[k].frequency;
+    thrs->drorder[k].index = k;
+  }
+  qsort(thrs->drorder, thrs->compdatacount, sizeof(dr_peak),
+        dr_peak_comparator);
+  if ( !thrs->drhead && dr_grow_list(thrs, 0) ) return 1;
+  return 0;
+}
+
+/** Store the compdata rows of the peaks within tol of freq in
+ * thrs->drnear, in compdata order.
+ *
+ * \returns The number of peaks found.
+ */
+int dr_near_peaks(specthreadopts_t *thrs, float freq, float tol) {
+  int lo = 0, hi = thrs->compdatacount, first, n;
+  /* The float difference is monotonic in the peak frequency, so the
+   * peaks with fabsf(peak-freq) <= tol are a contiguous run. */
+  while ( lo < hi ) {
+    int mid = lo+(hi-lo)/2;
+    float d = thrs->drorder[mid].frequency-freq;
+    if ( d < -tol ) lo = mid+1;
+    else hi = mid;
+  }
+  first = lo;
+  for ( hi = thrs->compdatacount; lo < hi; ) {
+    int mid = lo+(hi-lo)/2;
+    float d = thrs->drorder[mid].frequency-freq;
+    if ( d <= tol ) lo = mid+1;
+    else hi = mid;
+  }
+  for ( n = 0; n < lo-first; n++ )
+    thrs->drnear[n] = thrs->drorder[first+n].index;
+  qsort(thrs->drnear, n, sizeof(int), int_comparator);
+  return n;
+}
+
+/** Find the k-th smallest (counting from 0) of the n values in a, which
+ * are reordered. Runs in linear time on average (quickselect). */
+float select_float(float *a, int n, int k) {
+  int lo = 0, hi = n-1;
+  while ( lo < hi ) {
+    /* Median of three as pivot, to avoid the worst case on sorted input */
+    int mid = lo+(hi-lo)/2, i = lo, j = hi;
+    float pivot, t;
+    if ( a[mid] < a[lo] ) { t = a[mid]; a[mid] = a[lo]; a[lo] = t; }
+    if ( a[hi] < a[lo] ) { t = a[hi]; a[hi] = a[lo]; a[lo] = t; }
+    if ( a[hi] < a[mid] ) { t = a[hi]; a[hi] = a[mid]; a[mid] = t; }
+    pivot = a[mid];
+    while ( i <= j ) {
+      while ( a[i] < pivot ) i++;
+      while ( a[j] > pivot ) j--;
+      if ( i <= j ) { t = a[i]; a[i] = a[j]; a[j] = t; i++; j--; }
+    }
+    if ( k <= j ) hi = j;
+    else if ( k >= i ) lo = i;
+    else break;                 /* a[k] == pivot */
+  }
+  return a[k];
+}
+
+#ifndef _WIN32
+/** Start the SPCAT server (--spcat-pool) for a thread.
+ *
+ * \returns 0 on success.
+ */
+int spcat_pool_start(specopts_t *opts, specthreadopts_t *thrs) {
+  int topipe[2], frompipe[2];
+  /* Close-on-exec, so that servers (and anything else started by other
+   * threads) don't hold each other's pipes open. */
+  if ( pipe2(topipe, O_CLOEXEC) ) return 1;
+  if ( pipe2(frompipe, O_CLOEXEC) ) {
+    close(topipe[0]); close(topipe[1]);
+    return 1;
+  }
+  {
+    char *argv[] = { opts->spcatbin, "--server", NULL };
+    thrs->spcatpid = spawn_redirected(argv, topipe[0], frompipe[1]);
+  }
+  close(topipe[0]); close(frompipe[1]);
+  if ( thrs->spcatpid == -1 ) {
+    thrs->spcatpid = 0;
+    close(topipe[1]); close(frompipe[0]);
+    return 1;
+  }
+  thrs->spcatin = topipe[1];
+  thrs->spcatout = frompipe[0];
+  return 0;
+}
+
+/** Stop a thread's SPCAT server, if it is running. Closing its input makes
+ * it exit.
+ *
+ * \returns The server's wait status (see waitpid), or -1 if it was not
+ *     running or could not be waited for.
+ */
+int spcat_pool_stop(specthreadopts_t *thrs) {
+  int stat = -1;
+  pid_t rc;
+  if ( thrs->spcatpid <= 0 ) return -1;
+  close(thrs->spcatin); close(thrs->spcatout);
+  while ( ( rc = waitpid(thrs->spcatpid, &stat, 0) ) == -1 && errno == EINTR )
+    ;
+  thrs->spcatpid = 0;
+  return rc == -1 ? -1 : stat;
+}
+
+/** run_spcat using the thread's SPCAT server. If the server has died, it
+ * is restarted and the request is retried once. */
+int run_spcat_pool(const GA_session *ga, specthreadopts_t *thrs,
+                   GA_segment *x, unsigned int subfile, char **catbuf,
+                   size_t *catsize) {
   specopts_t *opts = (specopts_t *)ga->settings->ref;
-  specthreadopts_t *thrs = (specthreadopts_t *)thbuf;
-  GA_segment *x = elem->gdsegments;
-  int i = 0, j = 0;
-  FILE *fh;
-  int rc = 0;
-  /* int xi, yi; */
-  double fitness;
-  int scaledbins = opts->scaledbins;
-  const double binsize = ((double)(opts->obsrangemax-opts->obsrangemin))/scaledbins;
-  double obsbin[scaledbins], compbin[scaledbins];
-  int obsbincount[scaledbins], compbincount[scaledbins];
-  double binweights[scaledbins]; /* 20110215, J-weighting */
-  double binerror[scaledbins]; /* 20110804, Error propagation */
+  int rc, attempt, ok = 0;
+
+  rc = generate_input_buffers(opts, ga->generation, thrs->input, x, subfile);
+  if ( rc < 0 ) return rc;
+  for ( attempt = 0; attempt < 2 && !ok; attempt++ ) {
+    if ( thrs->spcatpid <= 0 && spcat_pool_start(opts, thrs) ) {
+      qprintf(ga->settings, "Failed to start spcat server: %s\n",
+              strerror(errno));
+      break;
+    }
+    if ( spcat_pipe_send(thrs->spcatin, thrs->input[0].buf,
+                         thrs->input[0].len) == 0 &&
+         spcat_pipe_send(thrs->spcatin, thrs->input[1].buf,
+                         thrs->input[1].len) == 0 &&
+         spcat_pipe_recv(thrs->spcatout, catbuf, catsize) == 0 )
+      ok = 1;
+    else {
+      pid_t pid = thrs->spcatpid;
+      int stat = spcat_pool_stop(thrs);
+      if ( stat != -1 && WIFSIGNALED(stat) )
+        qprintf(ga->settings, "spcat server %d killed by signal %d (%s)\n",
+                (int)pid, WTERMSIG(stat), strsignal(WTERMSIG(stat)));
+      else if ( stat != -1 && WIFEXITED(stat) )
+        qprintf(ga->settings, "spcat server %d exited with status %d\n",
+                (int)pid, WEXITSTATUS(stat));
+      else
+        qprintf(ga->settings, "spcat server %d failed\n", (int)pid);
+    }
+  }
+  if ( !ok ) {
+    if ( attempt < 2 ) return -11;
+    qprintf(ga->settings, "spcat did not return success\n");
+    return -10;
+  }
+  return rc;
+}
+#endif
+
+/** Run SPCAT on subfile number subfile of individual x, and open its .cat
+ * output in *catbuf (*catsize bytes, possibly none). If *catbuf is set on
+ * return, the caller must free it.
+ *
+ * \returns The next subfile to process, 0 if this was the last one, or the
+ *     negated error code.
+ */
+int run_spcat(const GA_session *ga, specthreadopts_t *thrs, GA_segment *x,
+              unsigned int subfile, char **catbuf, size_t *catsize) {
+  specopts_t *opts = (specopts_t *)ga->settings->ref;
+  int i = 0, rc = 0;
 #ifdef USE_SPCAT_OBJ
+  int failed;
   spcs_t spcs;
   char *buffers[NFILE];
   size_t bufsizes[NFILE];
@@ -1618,283 +3174,699 @@ int GA_fitness(const GA_session *ga, void *thbuf, GA_individual *elem) {
   char filename[256];
 #endif
 
-  rc = 0;
-  thrs->compdatacount = 0;
-  while ( 1 ) {
+#ifndef _WIN32
+  if ( opts->spcatpool )
+    return run_spcat_pool(ga, thrs, x, subfile, catbuf, catsize);
+#endif
+
 #ifdef USE_SPCAT_OBJ
-#error SPCAT_OBJ unsupported
-    /* Generate SPCAT input buffer */
-    rc = generate_input_buffers(opts, buffers, bufsizes, x);
-    if ( rc != 0 ) return rc;
-    if ( init_spcs(&spcs) ) return 11;
-    if ( spcat(&spcs, buffers, bufsizes) ) return 12;
-    if ( free_spcs(&spcs) ) return 13;
-    free(buffers[0]); free(buffers[1]);
-    /* Read SPCAT output buffer */
-    if ( !bufsizes[ecat] ) fh = NULL;
-    else if ( ( fh = fmemopen(buffers[ecat], bufsizes[ecat], "r") ) == NULL ) {
-      qprintf(ga->settings, "Failed to open file: %s\n", strerror(errno));
-      return 15;
-    }
-    /******** FIXME TODO NEED TO SORT ********/
+  /* Generate SPCAT input buffers. SPCAT only reads these. */
+  rc = generate_input_buffers(opts, ga->generation, thrs->input, x, subfile);
+  if ( rc < 0 ) return rc;
+  memset(buffers, 0, sizeof(buffers));
+  memset(bufsizes, 0, sizeof(bufsizes));
+  buffers[eint] = thrs->input[0].buf; bufsizes[eint] = thrs->input[0].len;
+  buffers[evar] = thrs->input[1].buf; bufsizes[evar] = thrs->input[1].len;
+
+  /* Run SPCAT in-process */
+  if ( init_spcs(&spcs) ) return -11;
+  spcs.quiet = TRUE;
+  spcs.winmin = opts->spcatwinmin;
+  spcs.winmax = opts->spcatwinmax;
+  spcs.pruneblocks = opts->pruneblocks;
+  failed = spcat(&spcs, buffers, bufsizes);
+  free_spcs(&spcs);
+  for ( i = 0; i < NFILE; i++ )
+    if ( i != eint && i != evar && i != ecat ) free(buffers[i]);
+  *catbuf = buffers[ecat];
+  *catsize = bufsizes[ecat];
+  if ( failed ) {
+    qprintf(ga->settings, "spcat did not return success\n");
+    return -10;
+  }
+  /* The .cat output is not sorted by frequency (unlike standalone SPCAT).
+   * parse_catbuf keeps it in line order, which is the same for the same
+   * parameters; the fitness sums and the double resonance check visit
+   * compdata in that order. The double resonance check finds peaks by
+   * frequency through its own index (dr_index_peaks), so it does not need
+   * sorted rows. */
 #else
-    /* Generate SPCAT input file */
-    rc = generate_input_files(opts, ga->generation, thrs->basename_temp, x,
-                              rc);
-    if ( rc < 0 ) return -rc;
+  /* Generate SPCAT input file */
+  rc = generate_input_files(opts, ga->generation, thrs->basename_temp, x,
+                            subfile, thrs->input);
+  if ( rc < 0 ) return rc;
 
-    /* Run SPCAT. Append a '.' to the end of the filename so that it
-     * doesn't choke on filenames with '.' in them (like ./foo).
-     */
+  /* Run SPCAT. Append a '.' to the end of the filename so that it
+   * doesn't choke on filenames with '.' in them (like ./foo).
+   */
 
-    /* This way we can avoid running /bin/sh for every fitness
-     * evaluation. This doesn't quite work as expected -- ^C often
-     * fails if we use the recommended signal handling code. */
-    //tprintf("Running %s %s\n", opts->spcatbin, filename);
+  /* This way we can avoid running /bin/sh for every fitness
+   * evaluation. This doesn't quite work as expected -- ^C often
+   * fails if we use the recommended signal handling code. */
+  //tprintf("Running %s %s\n", opts->spcatbin, filename);
 
 #ifdef _WIN32
-    snprintf(filename, sizeof(filename), "\"%s\" \"%s.\"",
-             opts->spcatbin, thrs->basename_temp);
-    {
-      STARTUPINFO si;
-      PROCESS_INFORMATION pi;
-      DWORD exitCode;
-
-      ZeroMemory(&si, sizeof(si));
-      ZeroMemory(&pi, sizeof(pi));
-      si.cb = sizeof(si);
-      //printf("[%s] %s\n", opts->spcatbin, filename);
-      i = CreateProcess(opts->spcatbin, filename, NULL, NULL, FALSE,
-                        DETACHED_PROCESS /* invisible */, NULL, NULL, &si, &pi);
-      if ( i == 0 ) {
-        printf("CreateProcess: [%s] %s: failed, GetLastError=%d\n",
-               opts->spcatbin, filename, GetLastError());
-        return 11;
-      }
-      /* Wait until child process exits. */
-      i = WaitForSingleObject(pi.hProcess, INFINITE);
-      if ( i != WAIT_OBJECT_0 ) {
-        printf("WaitForSingleObject [%s] %s: returned %d, GetLastError=%d\n",
-               opts->spcatbin, filename, i, GetLastError());
-        return 11;
-      }
-      i = GetExitCodeProcess(pi.hProcess, &exitCode);
-      if ( i == 0 ) {
-        printf("GetExitCodeProcess [%s] %s: failed, GetLastError=%d\n",
-               opts->spcatbin, filename, GetLastError());
-        return 11;
-      }
-      if ( exitCode != 0 ) {
-        printf("SPCAT returned nonzero: [%s] %s: Exit code %d\n",
-               opts->spcatbin, filename, exitCode);
-        return 10;
-      }
-      /* Close process and thread handles. */
-      CloseHandle(pi.hProcess);
-      CloseHandle(pi.hThread);
-    }
+  snprintf(filename, sizeof(filename), "\"%s\" \"%s.\"",
+           opts->spcatbin, thrs->basename_temp);
+  {
+    STARTUPINFO si;
+    PROCESS_INFORMATION pi;
+    DWORD exitCode;
+
+    ZeroMemory(&si, sizeof(si));
+    ZeroMemory(&pi, sizeof(pi));
+    si.cb = sizeof(si);
+    //printf("[%s] %s\n", opts->spcatbin, filename);
+    i = CreateProcess(opts->spcatbin, filename, NULL, NULL, FALSE,
+                      DETACHED_PROCESS /* invisible */, NULL, NULL, &si, &pi);
+    if ( i == 0 ) {
+      printf("CreateProcess: [%s] %s: failed, GetLastError=%d\n",
+             opts->spcatbin, filename, GetLastError());
+      return -11;
+    }
+    /* Wait until child process exits. */
+    i = WaitForSingleObject(pi.hProcess, INFINITE);
+    if ( i != WAIT_OBJECT_0 ) {
+      printf("WaitForSingleObject [%s] %s: returned %d, GetLastError=%d\n",
+             opts->spcatbin, filename, i, GetLastError());
+      return -11;
+    }
+    i = GetExitCodeProcess(pi.hProcess, &exitCode);
+    if ( i == 0 ) {
+      printf("GetExitCodeProcess [%s] %s: failed, GetLastError=%d\n",
+             opts->spcatbin, filename, GetLastError());
+      return -11;
+    }
+    if ( exitCode != 0 ) {
+      printf("SPCAT returned nonzero: [%s] %s: Exit code %d\n",
+             opts->spcatbin, filename, exitCode);
+      return -10;
+    }
+    /* Close process and thread handles. */
+    CloseHandle(pi.hProcess);
+    CloseHandle(pi.hThread);
+  }
 #else
-    snprintf(filename, sizeof(filename), "%s.", thrs->basename_temp);
-    i = invisible_system(opts->devnullfd, 2, opts->spcatbin, filename);
-    if ( i != 0 ) {
-      qprintf(ga->settings, "Failed to start spcat (--spcat to specify path)\n");
-      return 11;
-    }
-    if ( !WIFEXITED(i) || ( WEXITSTATUS(i) != 0 ) ) {
-      qprintf(ga->settings, "spcat did not return success\n");
-      return 10;
-    }
+  snprintf(filename, sizeof(filename), "%s.", thrs->basename_temp);
+  i = invisible_system(opts->devnullfd, 2, opts->spcatbin, filename);
+  if ( i != 0 ) {
+    qprintf(ga->settings, "Failed to start spcat (--spcat to specify path)\n");
+    return -11;
+  }
+  if ( !WIFEXITED(i) || ( WEXITSTATUS(i) != 0 ) ) {
+    qprintf(ga->settings, "spcat did not return success\n");
+    return -10;
+  }
 #endif
 
-    /* Read SPCAT output file */
-    snprintf(filename, sizeof(filename), "%s.cat", thrs->basename_temp);
-    if ( ( fh = fopen(filename, "r") ) == NULL ) {
-      qprintf(ga->settings, "Failed to open cat file: %s\n", strerror(errno));
-      return 15;
-    }
+  /* Read SPCAT output file */
+  snprintf(filename, sizeof(filename), "%s.cat", thrs->basename_temp);
+  if ( read_file(filename, catbuf, catsize) ) {
+    qprintf(ga->settings, "Failed to read cat file: %s\n", strerror(errno));
+    return -15;
+  }
 #endif
 
-    i = load_catfile(fh, &(thrs->compdata), &(thrs->compdatasize),
-                    &(thrs->compdatacount));
-    if ( i > 0 ) return 20+i;
-    fclose(fh);
+  return rc;
+}
 
-    /* Is there another subfile we need to process? */
-    if ( rc == 0 ) break;
+spectrum_cache *spectrum_cache_new(size_t budget) {
+  spectrum_cache *sc = malloc(sizeof(spectrum_cache));
+  if ( !sc ) return NULL;
+  memset(sc, 0, sizeof(spectrum_cache));
+  sc->budget = budget;
+  sc->nbuckets = 1024;
+  if ( ( sc->buckets = calloc(sc->nbuckets, sizeof(spectrum_entry *)) )
+       == NULL ) {
+    free(sc);
+    return NULL;
+  }
+#if THREADS
+  if ( ( errno = pthread_mutex_init(&sc->mutex, NULL) ) != 0 ) {
+    free(sc->buckets); free(sc);
+    return NULL;
   }
+#endif
+  return sc;
+}
 
-  /* Determine fitness */
-  //tprintf("COUNTS: %d %d\n", opts->observationcount, thrs->compdatacount);
-  fitness = 0;
+void spectrum_cache_free(spectrum_cache *sc) {
+  spectrum_entry *e, *older;
+  for ( e = sc->newest; e; e = older ) { older = e->older; free(e); }
+#if THREADS
+  pthread_mutex_destroy(&sc->mutex);
+#endif
+  free(sc->buckets);
+  free(sc);
+}
+
+static void spectrum_cache_lock(spectrum_cache *sc) {
+#if THREADS
+  int rc = pthread_mutex_lock(&sc->mutex);
+  if ( rc ) { printf("spectrum_cache: mutex_lock: %d\n", rc); exit(1); }
+#endif
+}
+
+static void spectrum_cache_unlock(spectrum_cache *sc) {
+#if THREADS
+  int rc = pthread_mutex_unlock(&sc->mutex);
+  if ( rc ) { printf("spectrum_cache: mutex_unlock: %d\n", rc); exit(1); }
+#endif
+}
+
+static unsigned int spectrum_hash(const GA_segment *key, unsigned int keylen) {
+  unsigned int h = 2166136261u, i;     /* FNV-1a over the segment values */
+  for ( i = 0; i < keylen; i++ ) {
+    GA_segment v = key[i];
+    h = ( h^(unsigned int)(v^(v>>16>>16)) )*16777619u; /* Fold 64-bit */
+  }
+  return h;
+}
+
+/* Find the entry for key, or NULL. Must hold the lock. */
+static spectrum_entry **spectrum_cache_find(spectrum_cache *sc,
+                                            const GA_segment *key,
+                                            unsigned int keylen,
+                                            unsigned int hash) {
+  spectrum_entry **e = &sc->buckets[hash & (sc->nbuckets-1)];
+  for ( ; *e; e = &(*e)->hnext )
+    if ( (*e)->hash == hash && (*e)->keylen == keylen &&
+         memcmp((*e)->key, key, sizeof(GA_segment)*keylen) == 0 ) break;
+  return e;
+}
+
+/* Unlink e from the LRU list. Must hold the lock. */
+static void spectrum_cache_unlink(spectrum_cache *sc, spectrum_entry *e) {
+  if ( e->newer ) e->newer->older = e->older; else sc->newest = e->older;
+  if ( e->older ) e->older->newer = e->newer; else sc->oldest = e->newer;
+}
+
+/* Make e the most recently used entry. Must hold the lock. */
+static void spectrum_cache_push(spectrum_cache *sc, spectrum_entry *e) {
+  e->newer = NULL;
+  e->older = sc->newest;
+  if ( sc->newest ) sc->newest->newer = e; else sc->oldest = e;
+  sc->newest = e;
+}
+
+/** Append the cached rows for key to *storage (as parse_catbuf would).
+ *
+ * \returns 1 if found, 0 if not (or there is no cache), -1 if out of
+ *     memory.
+ */
+int spectrum_cache_get(spectrum_cache *sc, const GA_segment *key,
+                       unsigned int keylen, datarow **storage, int *size,
+                       int *count) {
+  const unsigned int hash = spectrum_hash(key, keylen);
+  spectrum_entry *e;
+  int rc = 0;
+  if ( !sc ) return 0;
+  spectrum_cache_lock(sc);
+  if ( ( e = *spectrum_cache_find(sc, key, keylen, hash) ) != NULL ) {
+    if ( *count+e->count > *size ) {
+      datarow *rows = realloc(*storage, sizeof(datarow)*(*count+e->count));
+      if ( rows ) { *storage = rows; *size = *count+e->count; }
+    }
+    if ( *count+e->count > *size ) rc = -1;
+    else {
+      memcpy(*storage+*count, e->rows, sizeof(datarow)*e->count);
+      *count += e->count;
+      spectrum_cache_unlink(sc, e);
+      spectrum_cache_push(sc, e);
+      sc->hits++;
+      rc = 1;
+    }
+  }
+  else sc->misses++;
+  spectrum_cache_unlock(sc);
+  return rc;
+}
+
+/** Store a copy of the count rows for key, evicting the least recently
+ * used entries to make room. Failing to store is not an error. */
+void spectrum_cache_put(spectrum_cache *sc, const GA_segment *key,
+                        unsigned int keylen, const datarow *rows,
+                        int count) {
+  const unsigned int hash = spectrum_hash(key, keylen);
+  const size_t size = sizeof(spectrum_entry)+sizeof(GA_segment)*keylen+
+    sizeof(datarow)*count;
+  spectrum_entry *e, **slot;
+  if ( !sc || size > sc->budget ) return;
+  /* One block: entry, key, then rows */
+  if ( ( e = malloc(size) ) == NULL ) return;
+  e->hash = hash;
+  e->size = size;
+  e->keylen = keylen;
+  e->count = count;
+  e->key = (GA_segment *)(e+1);
+  e->rows = (datarow *)(e->key+keylen);
+  memcpy(e->rows, rows, sizeof(datarow)*count);
+  memcpy(e->key, key, sizeof(GA_segment)*keylen);
+
+  spectrum_cache_lock(sc);
+  if ( *( slot = spectrum_cache_find(sc, key, keylen, hash) ) != NULL ) {
+    /* Another thread got here first */
+    spectrum_cache_unlock(sc);
+    free(e);
+    return;
+  }
+  /* Evict */
+  while ( sc->oldest && sc->used+size > sc->budget ) {
+    spectrum_entry *old = sc->oldest, **p;
+    for ( p = &sc->buckets[old->hash & (sc->nbuckets-1)]; *p != old;
+          p = &(*p)->hnext ) ;
+    *p = old->hnext;
+    spectrum_cache_unlink(sc, old);
+    sc->used -= old->size;
+    sc->nentries--;
+    free(old);
+  }
+  /* Insert (the slot may have moved if a bucket's chain was changed) */
+  slot = &sc->buckets[hash & (sc->nbuckets-1)];
+  e->hnext = *slot;
+  *slot = e;
+  spectrum_cache_push(sc, e);
+  sc->used += size;
+  sc->nentries++;
+  /* Keep chains short */
+  if ( sc->nentries > 2*sc->nbuckets ) {
+    spectrum_entry **buckets = calloc(2*sc->nbuckets, sizeof(spectrum_entry *));
+    if ( buckets ) {
+      spectrum_entry *f;
+      sc->nbuckets *= 2;
+      for ( f = sc->newest; f; f = f->older ) {
+        spectrum_entry **b = &buckets[f->hash & (sc->nbuckets-1)];
+        f->hnext = *b;
+        *b = f;
+      }
+      free(sc->buckets);
+      sc->buckets = buckets;
+    }
+  }
+  spectrum_cache_unlock(sc);
+}
+
+/** One bin's term of the fitness, see score_bins */
+static inline double bin_score(float w, double obsbin, double compbin,
+                               int obsbincount, int compbincount,
+                               double binweight, double binerror) {
+  float d = (obsbin>compbin?.5:-1)*(obsbin-compbin);
+  float n = abs(obsbincount-compbincount);
+  float comp = w*(d*d) + (1-w)*(n*n);
+  double err = binerror < .01 ? .01 : binerror;
+  return comp*binweight*err;
+}
+
+/** Compute bin fitnesses using w*|X_o - X_c|^2 + (1-w)*|N_o - N_c|^2,
+ * weighted by the bins' J-weights and errors, and add them up. binerror is
+ * overwritten with the per-bin terms.
+ *
+ * The terms are computed in one pass that the compiler can vectorize, and
+ * summed in bin order in a second, so every version of this function gives
+ * the same result.
+ */
+VECTOR_CLONES
+double score_bins(int nbins, float w, const double *obsbin,
+                  const double *compbin, const int *obsbincount,
+                  const int *compbincount, const double *binweights,
+                  double *binerror) {
+  double fitness = 0;
+  int i;
+  for ( i = 0; i < nbins; i++ )
+    binerror[i] = bin_score(w, obsbin[i], compbin[i], obsbincount[i],
+                            compbincount[i], binweights[i], binerror[i]);
+  for ( i = 0; i < nbins; i++ ) fitness += binerror[i];
+  return fitness;
+}
 
-  /* Check double resonance */
+/** Bin the computed peaks in rows like observation ob, into cb (which is
+ * grown as necessary). Peaks whose error exceeds the larger of ten bins
+ * and peakerr are left out.
+ *
+ * \returns 0 on success, nonzero if out of memory.
+ */
+int bin_computed(const specopts_t *opts, const spec_observation *ob,
+                 const datarow *rows, int count, float peakerr,
+                 computed_bins *cb) {
+  const int scaledbins = ob->nbins;
+  const double binsize = ((double)(opts->obsrangemax-opts->obsrangemin))/scaledbins;
+  int i;
+
+  if ( cb->size < scaledbins ) {
+    free(cb->compbin); free(cb->compbincount);
+    free(cb->binweights); free(cb->binerror);
+    cb->size = 0;
+    cb->compbin = malloc(sizeof(double)*scaledbins);
+    cb->compbincount = malloc(sizeof(int)*scaledbins);
+    cb->binweights = malloc(sizeof(double)*scaledbins);
+    cb->binerror = malloc(sizeof(double)*scaledbins);
+    if ( !cb->compbin || !cb->compbincount || !cb->binweights ||
+         !cb->binerror ) return 1;
+    cb->size = scaledbins;
+  }
+
+  /* Initialize bins */
+  for ( i = 0; i < scaledbins; i++ ) {
+    cb->compbin[i] = 0; cb->compbincount[i] = 0;
+    cb->binweights[i] = 0; cb->binerror[i] = 0;
+  }
+
+  /* Compute error tolerance - 20110925 */
+  float errtol = binsize*10;
+  if ( peakerr > errtol ) errtol = peakerr;
+
+  for ( i=0; i<count; i++ ) {
+    const datarow *entry = &rows[i]; /* Generated */
+    if ( ( entry->frequency < opts->obsrangemin ) ||
+         ( entry->frequency > opts->obsrangemax ) )
+      continue;
+    /* We're within the valid range */
+    int bin = floor((entry->frequency-opts->obsrangemin)/binsize);
+    if ( bin >= scaledbins ) bin = scaledbins-1;
+    /* Skip peaks that are too imprecise to bin. 20110910 */
+    /* Unfortunately, we need to skip many fewer peaks. */
+    if ( entry->error > errtol ) continue;
+    //double weight = fabs(entry.b/obsmax);
+    //if ( weight < 1 ) weight = 1;
+    /* Prediction - scale me */
+    cb->compbin[bin] += entry->intensity;//*weight;
+    cb->compbincount[bin]++;
+    //printf("BW: sqrt(2/%d)\n",entry.qn[0]+entry.qn[3]);
+    cb->binweights[bin] += jweight(entry->qn[0]+entry->qn[3]); /* 20110215 */
+    cb->binerror[bin] += entry->error;
+  }
+  return 0;
+}
+
+/** Score the computed peaks, binned by bin_computed, against observation
+ * ob. Overwrites cb->binerror.
+ */
+double score_observation(const specopts_t *opts, const spec_observation *ob,
+                         computed_bins *cb) {
+  const int scaledbins = ob->nbins;
+  const double *obsbin = ob->obsbin;       /* Shared, see bin_observation */
+#if 0 /* EXPERIMENTAL BEHAVIOR 2010-09-26 */
+  double binweights[scaledbins];
+  sortable_bin binorder[scaledbins];
+  for ( i = 0; i < scaledbins; i++ ) {
+    binorder[i].index = i; binorder[i].total = compbin[i];
+  }
+  qsort(binorder, scaledbins, sizeof(sortable_bin), bin_comparator);
+  double binmin = binorder[scaledbins-1].total;
+  double bindiff = binorder[0].total-binmin;
+  for ( i = 0; i < scaledbins; i++ ) {
+    binweights[i] = (obsbin[i]-binmin)/bindiff;
+  }
+#endif
+  return score_bins(scaledbins, opts->distanceweight, obsbin, cb->compbin,
+                    ob->obsbincount, cb->compbincount, cb->binweights,
+                    cb->binerror);
+}
+
+/** Score the computed peaks, binned by bin_computed, against only the
+ * strongest bins of observation ob. No bin's term is negative, so this is
+ * a lower bound for score_observation.
+ */
+double bound_observation(const specopts_t *opts, const spec_observation *ob,
+                         const computed_bins *cb) {
+  double bound = 0;
+  int i;
+  for ( i = 0; i < ob->nstrong; i++ ) {
+    int bin = ob->strong[i];
+    bound += bin_score(opts->distanceweight, ob->obsbin[bin],
+                       cb->compbin[bin], ob->obsbincount[bin],
+                       cb->compbincount[bin], cb->binweights[bin],
+                       cb->binerror[bin]);
+  }
+  return bound;
+}
+
+/* Second radiation constant hc/k (cm K), and MHz per cm-1 */
+#define RAD_C2      1.4387770
+#define MHZ_PER_CM  29979.2458
+
+/** Copy the computed peaks to thrs->rescaled, with intensities rescaled
+ * from the temperature SPCAT used for each subfile (its TEMP) to
+ * temperature, and normalized to the strongest line again. A line's
+ * intensity goes with exp(-c2*Elo/T)*(1-exp(-c2*freq/T))/Q(T). Q(T) is
+ * left out: for rigid rotors it goes with T^1.5, which changes every
+ * subfile of the same TEMP alike, so it cancels in the normalization.
+ *
+ * \returns The rescaled rows, or NULL if out of memory.
+ */
+const datarow *rescale_rows(const specopts_t *opts, specthreadopts_t *thrs,
+                            float temperature, const int *subfirst,
+                            unsigned int nsubfiles) {
+  datarow *rows;
+  double maxlog = -HUGE_VAL;
+  unsigned int k;
+  int i, rescaled = 0;
+  if ( thrs->rescaledsize < thrs->compdatacount ) {
+    if ( ( rows = realloc(thrs->rescaled, sizeof(datarow)*
+                                          thrs->compdatacount) ) == NULL )
+      return NULL;
+    thrs->rescaled = rows;
+    thrs->rescaledsize = thrs->compdatacount;
+  }
+  rows = thrs->rescaled;
+  memcpy(rows, thrs->compdata, sizeof(datarow)*thrs->compdatacount);
+  for ( k = 0; k < nsubfiles; k++ ) {
+    const double t0 = opts->subfileinputs[k].temperature;
+    if ( t0 > 0 && t0 != temperature ) rescaled = 1;
+  }
+  if ( !rescaled ) return rows;
+  /* Work with log intensities, low temperatures underflow otherwise */
+  for ( k = 0; k < nsubfiles; k++ ) {
+    const double t0 = opts->subfileinputs[k].temperature;
+    for ( i = subfirst[k]; i < subfirst[k+1]; i++ ) {
+      const double x = RAD_C2*rows[i].frequency/MHZ_PER_CM;
+      double l;
+      if ( !(rows[i].intensity > 0) ) {
+        rows[i].intensity = -HUGE_VALF;
+        continue;
+      }
+      l = log(rows[i].intensity);
+      if ( t0 > 0 && t0 != temperature )
+        l += -RAD_C2*rows[i].elo*(1/temperature-1/t0)+
+          log(-expm1(-x/temperature))-log(-expm1(-x/t0));
+      rows[i].intensity = l;
+      if ( l > maxlog ) maxlog = l;
+    }
+  }
+  for ( i = subfirst[0]; i < subfirst[nsubfiles]; i++ )
+    rows[i].intensity = maxlog > -HUGE_VAL ?
+      exp(rows[i].intensity-maxlog) : 0;
+  return rows;
+}
+
+/** Check that the computed peaks in thrs->compdata contain every double
+ * resonance relation of --drfile.
+ *
+ * \returns 0 if they do, 1 if one is missing, 35 if out of memory.
+ */
+int check_double_resonance(const GA_session *ga, specthreadopts_t *thrs) {
+  specopts_t *opts = (specopts_t *)ga->settings->ref;
+  int i = 0, j = 0;
 
   /* BUG -- Need to check against *either* of the dblreses of first item
    * -- they don't need to to all be the same. */
   /* Isn't that fixed ? */
 
   int drfail = 0;
+  if ( opts->doublereslen > 0 && dr_index_peaks(thrs) ) {
+    qprintf(ga->settings, "Out of memory: %s\n", strerror(errno));
+    return 35;
+  }
   for ( i = 0; i < opts->doublereslen; i++ ) { /* For each resonance */
     int drlen = 0; /* Reset the QN list */
+    memset(thrs->drhead, 0xff, sizeof(int)*thrs->drhashsize);
     //printf("Starting QN:\n");
     /* For each frequency in the resonance */
     for ( j = 0; j < opts->doubleres[i].npeaks; j++ ) {
-      int k = 0;
+      int k = 0, nnear;
       drfail = 1; /* If we don't find a match for this frequency, fail */
-      for ( k = 0; k < thrs->compdatacount; k++ ) { /* For each actual peak */
-        int l = 0, m = 0;
-        /* Check if this peak is near the resonance frequency */
-        if ( fabsf(thrs->compdata[k].frequency-opts->doubleres[i].peaks[j])
-             > opts->doublerestol ) continue;
+      /* Peaks near the resonance frequency, in compdata order */
+      nnear = dr_near_peaks(thrs, opts->doubleres[i].peaks[j],
+                            opts->doublerestol);
+      for ( k = 0; k < nnear; k++ ) { /* For each actual peak */
+        const datarow *peak = &thrs->compdata[thrs->drnear[k]];
+        int m = 0;
 
         /* For each quantum number associated with the peak */
         for ( m = 0; m < QN_COUNT; m++ ) {
-          int found = 0;
-          //printf("Looking for QN %d %d %d\n",thrs->compdata[k].qn[m*QN_DIGITS],
-          //thrs->compdata[k].qn[m*QN_DIGITS+1],thrs->compdata[k].qn[m*QN_DIGITS+2]);
-          /* Check all previously seen quantum numbers */
-          for ( l = 0; l < drlen; l++ ) {
-            int n = 0;
-            /* Specifically, each of the QN_COUNT quantum numbers */
-            for ( n = 0; n < QN_COUNT; n++ ) {
-              if ( memcmp(&(thrs->drlist[l].qn[n*QN_DIGITS]),
-                          &(thrs->compdata[k].qn[m*QN_DIGITS]),
-                          sizeof(int)*QN_DIGITS) == 0 ) {
-                /* We found the QN, skip it unless it was also found last time */
-                if ( thrs->drlist[l].seen >= j ) {
-                  //printf("  Match QN %d %d %d\n", drlist[l].qn[n*QN_DIGITS],
-                  //  drlist[l].qn[n*QN_DIGITS+1], drlist[l].qn[n*QN_DIGITS+2]);
-                  thrs->drlist[l].seen = j+1;
-                  found = 1;
-                  /* break; */
-                }
-              }
+          const int *qn = &peak->qn[m*QN_DIGITS];
+          int found = 0, slot;
+          /* Check all previously seen quantum numbers: slot is quantum
+           * number slot%QN_COUNT of list entry slot/QN_COUNT */
+          for ( slot = thrs->drhead[qn_hash(qn) & (thrs->drhashsize-1)];
+                slot >= 0; slot = thrs->drnext[slot] ) {
+            dblres_check *entry = &thrs->drlist[slot/QN_COUNT];
+            if ( memcmp(&entry->qn[(slot%QN_COUNT)*QN_DIGITS], qn,
+                        sizeof(int)*QN_DIGITS) != 0 ) continue;
+            /* We found the QN, skip it unless it was also found last time */
+            if ( entry->seen >= j ) {
+              entry->seen = j+1;
+              found = 1;
             }
           }
 
           /* If any matches were found, we haven't failed yet */
-          if ( found ) {
-            drfail = 0;
-            /*
-            if ( memcmp(drlist[l].qn, thrs->compdata[k].qn,
-                        sizeof(drlist[drlen].qn)) != 0 )
-              found = 0; *//* Differs, so add anyway */ /* FIXME */
-          }
+          if ( found ) drfail = 0;
           /* For first frequency in resonance, we can add the QN to the list */
           if ( !found && j == 0 ) {
-            if ( drlen >= thrs->drsize ) {
-              thrs->drsize = (thrs->drsize+1)*2;
-              //printf("Increasing memory allocation to %u\n", thrs->compdatasize);
-              thrs->drlist = realloc(thrs->drlist,
-                                     sizeof(dblres_check)*thrs->drsize);
-              if ( thrs->drlist == NULL ) {
-                qprintf(ga->settings, "Out of memory: %s\n", strerror(errno));
-                return 35;
-              }
+            if ( drlen >= thrs->drsize && dr_grow_list(thrs, drlen) ) {
+              qprintf(ga->settings, "Out of memory: %s\n", strerror(errno));
+              return 35;
             }
             thrs->drlist[drlen].seen = 1;
-            memcpy(thrs->drlist[drlen].qn, thrs->compdata[k].qn,
+            memcpy(thrs->drlist[drlen].qn, peak->qn,
                    sizeof(thrs->drlist[drlen].qn));
-            //printf("  Added QN %d %d %d %d %d %d\n", drlist[drlen].qn[0],
-            //    drlist[drlen].qn[1], drlist[drlen].qn[2], drlist[drlen].qn[3],
-            //    drlist[drlen].qn[4], drlist[drlen].qn[5]);
+            dr_hash_entry(thrs, drlen);
             drlen++;
             drfail = 0;
           }
-          //else if ( !found ) printf("  Not found\n");
         }
       }
       if ( drfail ) break;
     }
     if ( drfail ) break;
   }
-  if ( drfail ) {
-    elem->fitness = nan("fail"); /* Double resonance failed somewhere */
-    return 0;
+  return drfail;
+
+}
+
+int GA_fitness(const GA_session *ga, void *thbuf, GA_individual *elem) {
+  specopts_t *opts = (specopts_t *)ga->settings->ref;
+  specthreadopts_t *thrs = (specthreadopts_t *)thbuf;
+  GA_segment *x = elem->gdsegments;
+  int i = 0, j = 0;
+  int rc = 0;
+  /* int xi, yi; */
+  double fitness;
+  /* First row of each subfile's output, for rescale_rows */
+  int subfirst[opts->nsubfileinputs+1];
+  unsigned int nsubfiles = 0, k;
+  int earlyexit;
+
+  rc = 0;
+  thrs->compdatacount = 0;
+  while ( 1 ) {
+    /* Cache key: subfile number, then the segments it is rendered from */
+    GA_segment key[opts->componentcount*SEGMENTS+1];
+    unsigned int keylen = 0, subfile = rc;
+    int first = thrs->compdatacount;
+    if ( subfile < opts->nsubfileinputs ) {
+      subfirst[subfile] = first;
+      nsubfiles = subfile+1;
+    }
+    if ( opts->speccache && subfile < opts->nsubfileinputs ) {
+      const subfile_inputs *si = &opts->subfileinputs[subfile];
+      key[keylen++] = subfile;
+      for ( j = 0; j < si->nsegments; j++ ) key[keylen++] = x[si->segments[j]];
+    }
+    i = keylen ? spectrum_cache_get(opts->speccache, key, keylen,
+                                    &(thrs->compdata), &(thrs->compdatasize),
+                                    &(thrs->compdatacount)) : 0;
+    if ( i < 0 ) {
+      qprintf(ga->settings, "Out of memory: %s\n", strerror(errno));
+      return 35;
+    }
+    else if ( i > 0 ) /* Cached; the .var template decides what follows */
+      rc = subfile+1 < opts->compiled[1].nsubfiles ? subfile+1 : 0;
+    else {
+      char *catbuf = NULL;
+      size_t catsize = 0;
+      rc = run_spcat(ga, thrs, x, subfile, &catbuf, &catsize);
+      if ( rc < 0 ) { free(catbuf); return -rc; }
+      i = parse_catbuf(catbuf, catsize, &(thrs->compdata),
+                       &(thrs->compdatasize), &(thrs->compdatacount));
+      free(catbuf);
+      if ( i > 0 ) return 20+i;
+      if ( keylen )
+        spectrum_cache_put(opts->speccache, key, keylen,
+                           thrs->compdata+first, thrs->compdatacount-first);
+    }
+
+    /* Is there another subfile we need to process? */
+    if ( rc == 0 ) break;
   }
+  normalize_intensities(thrs->compdata, thrs->compdatacount);
 
-  /* Initialize bins */
-  for ( i = 0; i < scaledbins; i++ ) {
-    obsbin[i] = 0; compbin[i] = 0;
-    obsbincount[i] = 0; compbincount[i] = 0;
-    binweights[i] = 0; binerror[i] = 0;
+  /* Determine fitness */
+  //tprintf("COUNTS: %d %d\n", opts->observationcount, thrs->compdatacount);
+  fitness = 0;
+
+  /* Check double resonance first, so that --early-exit can't change which
+   * individuals fail it */
+  earlyexit = opts->earlyexit > 0 && ga->threshold > -HUGE_VAL;
+  if ( ( rc = check_double_resonance(ga, thrs) ) != 0 ) {
+    if ( rc != 1 ) return rc;
+    elem->fitness = nan("fail"); /* Double resonance failed somewhere */
+    return 0;
   }
 
-  /* Compute error tolerance - 20110925 */
-  float errtol = binsize*10;
+  /* Error of the 25th most precise peak in range, for the error tolerance */
+  float peakerr = 0;
   {
-    /* Find the 25 most precise peaks */
-    qsort(thrs->compdata, thrs->compdatacount, sizeof(datarow),
-          peak_error_comparator);
+    int n = 0;
+    if ( thrs->errorssize < thrs->compdatacount ) {
+      float *errors = realloc(thrs->errors,
+                              sizeof(float)*thrs->compdatacount);
+      if ( errors == NULL ) {
+        qprintf(ga->settings, "Out of memory: %s\n", strerror(errno));
+        return 35;
+      }
+      thrs->errors = errors;
+      thrs->errorssize = thrs->compdatacount;
+    }
     for ( j = 0; j < thrs->compdatacount; j++ ) {
       datarow *entry = &thrs->compdata[j];
       if ( ( entry->frequency < opts->obsrangemin ) ||
            ( entry->frequency > opts->obsrangemax ) )
         continue;
-      j++;
-      if ( j > 24 ) break;
-    }
-    if ( i >= thrs->compdatacount ) i = thrs->compdatacount-1;
-    if ( i >= 0 ) {
-      if ( thrs->compdata[i].error > errtol ) errtol = thrs->compdata[i].error;
+      thrs->errors[n++] = entry->error;
     }
+    if ( n > 0 ) peakerr = select_float(thrs->errors, n, n > 25 ? 24 : n-1);
   }
 
-  //double obsmax=0/*, obsmin = 0*/;
-  for ( j=0;j<=1;j++ ) {        /* 0=Observed / 1=Generated */
-    for ( i=0; i<((j==0)?opts->observationcount:thrs->compdatacount); i++ ) {
-      datarow *entry;
-      if ( j == 0 ) entry = &opts->observation[i]; /* Observed */
-      else entry = &thrs->compdata[i]; /* Generated */
-      if ( ( entry->frequency < opts->obsrangemin ) ||
-           ( entry->frequency > opts->obsrangemax ) )
-        continue;
-      /* We're within the valid range */
-      int bin = floor((entry->frequency-opts->obsrangemin)/binsize);
-      if ( bin >= scaledbins ) bin = scaledbins-1;
-      if ( j == 0 ) {
-        obsbin[bin] += entry->intensity;
-        obsbincount[bin]++;
-        //if ( i == 0 || entry.b > obsmax ) obsmax = entry.b;
-      }
-      else {
-        /* Skip peaks that are too imprecise to bin. 20110910 */
-        /* Unfortunately, we need to skip many fewer peaks. */
-        if ( entry->error > errtol ) continue;
-        //double weight = fabs(entry.b/obsmax);
-        //if ( weight < 1 ) weight = 1;
-        /* Prediction - scale me */
-        compbin[bin] += entry->intensity;//*weight;
-        compbincount[bin]++;
-        //printf("BW: sqrt(2/%d)\n",entry.qn[0]+entry.qn[3]);
-        binweights[bin] += sqrt(2.0/(entry->qn[0]+entry->qn[3])); /* 20110215 */
-        binerror[bin] += entry->error;
-      }
+  /* Bin like each observation */
+  subfirst[nsubfiles] = thrs->compdatacount;
+  for ( k = 0; k < opts->nobs; k++ ) {
+    const spec_observation *ob = &opts->obs[k];
+    const datarow *rows = thrs->compdata;
+    if ( ( ob->temperature != 0 &&
+           ( rows = rescale_rows(opts, thrs, ob->temperature, subfirst,
+                                 nsubfiles) ) == NULL ) ||
+         bin_computed(opts, ob, rows, thrs->compdatacount, peakerr,
+                      &thrs->cbins[k]) ) {
+      qprintf(ga->settings, "Out of memory: %s\n", strerror(errno));
+      return 35;
     }
   }
-#if 0 /* EXPERIMENTAL BEHAVIOR 2010-09-26 */
-  double binweights[scaledbins];
-  sortable_bin binorder[scaledbins];
-  for ( i = 0; i < scaledbins; i++ ) {
-    binorder[i].index = i; binorder[i].total = compbin[i];
-  }
-  qsort(binorder, scaledbins, sizeof(sortable_bin), bin_comparator);
-  double binmin = binorder[scaledbins-1].total;
-  double bindiff = binorder[0].total-binmin;
-  for ( i = 0; i < scaledbins; i++ ) {
-    binweights[i] = (obsbin[i]-binmin)/bindiff;
-  }
-#endif
-  /* Compute bin fitnesses using w*|X_o - X_c|^2 + (1-w)*|N_o - N_c|^2 */
-  for ( i=0; i<scaledbins; i++ ) {
-    float comp = opts->distanceweight *
-      //powf(fabs(obsbin[i]-compbin[i]),2) +
-      powf((obsbin[i]>compbin[j]?.5:-1)*(obsbin[i]-compbin[i]),2) +
-      (1-opts->distanceweight)*powf(fabs(obsbincount[i]-compbincount[i]),2);
-    if ( binerror[i] < .01 ) binerror[i] = .01;
-    fitness += comp*binweights[i]*binerror[i];
+
+  /* With --early-exit, stop as soon as a partial score (the strongest
+   * bins, then each observation in turn) puts this individual below the
+   * elites. Its fitness is then overestimated. */
+  if ( earlyexit ) {
+    for ( k = 0; k < opts->nobs; k++ )
+      fitness += opts->obs[k].weight*
+        bound_observation(opts, &opts->obs[k], &thrs->cbins[k]);
+    if ( -fitness*1000 < ga->threshold ) {
+      elem->fitness = -fitness*1000;
+      return 0;
+    }
+    fitness = 0;
   }
 
+  /* Score against each observation */
+  for ( k = 0; k < opts->nobs; k++ ) {
+    fitness += opts->obs[k].weight*
+      score_observation(opts, &opts->obs[k], &thrs->cbins[k]);
+    if ( earlyexit && -fitness*1000 < ga->threshold ) {
+      elem->fitness = -fitness*1000;
+      return 0;
+    }
+  }
   elem->fitness = -fitness*1000;
   /* printf("%u\n",elem->segments[0]); */
   /* elem->fitness = -fabs(64-(double)x[0]*x[0]); */
@@ -1915,14 +3887,53 @@ int GA_thread_init(GA_thread *thread) {
   opts->compdatacount = 0;
   opts->drlist = NULL;
   opts->drsize = 0;
+  opts->drhead = opts->drnext = NULL;
+  opts->drhashsize = 0;
+  opts->drorder = NULL;
+  opts->drnear = NULL;
+  opts->drordersize = 0;
+  opts->errors = NULL;
+  opts->errorssize = 0;
+  opts->rescaled = NULL;
+  opts->rescaledsize = 0;
+  opts->cbins = calloc(((specopts_t *)(thread->session->settings->ref))->nobs,
+                       sizeof(computed_bins));
+  if ( opts->cbins == NULL ) return 1;
+  memset(opts->input, 0, sizeof(opts->input));
 
 #ifndef USE_SPCAT_OBJ
   /* Use separate temporary files for each thread. */
-  opts->basename_temp = make_spec_temp
-    (((specopts_t *)(thread->session->settings->ref))->tempdir);
-  if ( opts->basename_temp == NULL ) return 1;
-  qprintf(thread->session->settings, "Using temporary file %s\n",
-          opts->basename_temp);
+  opts->basename_temp = NULL;
+  if ( !((specopts_t *)(thread->session->settings->ref))->spcatpool ) {
+    opts->basename_temp = make_spec_temp
+      (((specopts_t *)(thread->session->settings->ref))->tempdir);
+    if ( opts->basename_temp == NULL ) return 1;
+    qprintf(thread->session->settings, "Using temporary file %s\n",
+            opts->basename_temp);
+  }
+#endif
+#ifndef _WIN32
+  opts->spcatpid = 0;
+  if ( ((specopts_t *)(thread->session->settings->ref))->spcatpool ) {
+    if ( spcat_pool_start(thread->session->settings->ref, opts) ) {
+      qprintf(thread->session->settings, "Failed to start spcat server: %s\n",
+              strerror(errno));
+      return 1;
+    }
+    qprintf(thread->session->settings, "Started spcat server %d\n",
+            (int)opts->spcatpid);
+#if THREADS && defined(__linux__) && !defined(CLIENT_ONLY)
+    /* This runs on the main thread, so the server doesn't inherit the
+     * worker thread's --pin CPU the way a restarted one does. */
+    if ( thread->session->settings->pinmode != GA_PIN_NONE ) {
+      cpu_set_t set;
+      if ( pthread_getaffinity_np(thread->threadid, sizeof(set), &set) ||
+           sched_setaffinity(opts->spcatpid, sizeof(set), &set) )
+        qprintf(thread->session->settings,
+                "Unable to pin spcat server %d\n", (int)opts->spcatpid);
+    }
+#endif
+  }
 #endif
 
   thread->ref = (void *)opts;
@@ -1931,11 +3942,13 @@ int GA_thread_init(GA_thread *thread) {
 
 int GA_thread_free(GA_thread *thread) {
   specthreadopts_t *thrs = (specthreadopts_t *)(thread->ref);
+  unsigned int k;
 
   /* Remove temporary files. */
 #ifndef USE_SPCAT_OBJ
   char *filename;
-  if ( ( filename = malloc(strlen(thrs->basename_temp)+5) ) != NULL ) {
+  if ( !thrs->basename_temp ) ; /* None (--spcat-pool) */
+  else if ( ( filename = malloc(strlen(thrs->basename_temp)+5) ) != NULL ) {
     int i;
     for ( i = 0; i < 2; i++ ) {
       int j;
@@ -1952,113 +3965,93 @@ int GA_thread_free(GA_thread *thread) {
   free(thrs->basename_temp);
 #endif
 
+#ifndef _WIN32
+  spcat_pool_stop(thrs);
+#endif
+
+  free(thrs->input[0].buf); free(thrs->input[1].buf);
   free(thrs->compdata);
+  free(thrs->drlist);
+  free(thrs->drhead); free(thrs->drnext);
+  free(thrs->drorder); free(thrs->drnear);
+  free(thrs->errors);
+  free(thrs->rescaled);
+  for ( k = 0; k < ((specopts_t *)(thread->session->settings->ref))->nobs;
+        k++ ) {
+    free(thrs->cbins[k].compbin); free(thrs->cbins[k].compbincount);
+    free(thrs->cbins[k].binweights); free(thrs->cbins[k].binerror);
+  }
+  free(thrs->cbins);
   free(thrs);
   return 0;
 }
 
 #ifndef _WIN32
-pthread_mutex_t GA_iomutex = PTHREAD_MUTEX_INITIALIZER;
+/** Start argv[0] (a path, not searched for in PATH) with its STDIN and
+ * STDOUT replaced by stdinfd and stdoutfd (if not -1). Uses posix_spawn,
+ * which does not copy the address space like fork, and takes no locks,
+ * so threads can start processes concurrently.
+ *
+ * \returns The process ID, or -1 with errno set.
+ */
+pid_t spawn_redirected(char *const argv[], int stdinfd, int stdoutfd) {
+  posix_spawn_file_actions_t fa;
+  pid_t pid;
+  int rc;
+  if ( ( rc = posix_spawn_file_actions_init(&fa) ) != 0 ) {
+    errno = rc;
+    return -1;
+  }
+  /* The duplicates don't inherit close-on-exec */
+  if ( stdinfd != -1 )
+    rc = posix_spawn_file_actions_adddup2(&fa, stdinfd, STDIN_FILENO);
+  if ( rc == 0 && stdoutfd != -1 )
+    rc = posix_spawn_file_actions_adddup2(&fa, stdoutfd, STDOUT_FILENO);
+  if ( rc == 0 )
+    rc = posix_spawn(&pid, argv[0], &fa, NULL, argv, environ);
+  posix_spawn_file_actions_destroy(&fa);
+  if ( rc != 0 ) {
+    errno = rc;
+    return -1;
+  }
+  return pid;
+}
+
 /** Start a process with STDOUT redirected to the file descriptor
  * stdoutfd, wait for it to finish, and then return its exit status.
- * Thread-safe in conjunction with qprintf and tprintf.
- * This function based on the sample implementation of system from:
- * http://www.opengroup.org/onlinepubs/000095399/functions/system.html
+ * Safe to call from several threads at once.
  *
  * \see <a href="http://linux.die.net/man/3/system">system(3)</a>,
- *      qprintf, tprintf
+ *      spawn_redirected
  */
 int invisible_system(int stdoutfd, int argc, ...) {
   int stat;
   pid_t pid;
-  /*
-    struct sigaction sa, savintr, savequit;
-    sigset_t saveblock;
-  */
   va_list ap;
-  char **argv;
+  char *argv[argc > 0 ? argc+1 : 1];
   int i;
-  /* FIXME - Debug only */
-  //struct timeval starttime, endtime;
   if ( argc <= 0 ) {
     printf("invisible_system: argc <= 0\n");
     return 1;
   }
-  argv = malloc(sizeof(char*)*(argc+1));
-  if ( !argv ) {
-    printf("invisible_system: argv malloc failed\n");
-    return 1;
-  }
   va_start(ap, argc);
   for ( i = 0; i < argc; i++ ) {
     argv[i] = va_arg(ap, char *);
   }
   va_end(ap);
   argv[argc] = NULL;
-  /*
-  sa.sa_handler = SIG_IGN;
-  sigemptyset(&sa.sa_mask);
-  sa.sa_flags = 0;
-  sigemptyset(&savintr.sa_mask);
-  sigemptyset(&savequit.sa_mask);
-  sigaction(SIGINT, &sa, &savintr);
-  sigaction(SIGQUIT, &sa, &savequit);
-  sigaddset(&sa.sa_mask, SIGCHLD);
-  sigprocmask(SIG_BLOCK, &sa.sa_mask, &saveblock);
-  */
-
-  /* LOCK io */
-#if THREADS && !CLIENT_ONLY
-  stat = pthread_mutex_lock(&GA_iomutex);
-  if ( stat ) { printf("tprintf: mutex_lock(io): %d\n", stat); exit(1); }
-#endif
-  flockfile(stdout);
-  fflush(NULL);
-  //gettimeofday(&starttime, NULL);/* To compute runtime */
-  if ((pid = fork()) == 0) {
-    /*
-    sigaction(SIGINT, &savintr, (struct sigaction *)0);
-    sigaction(SIGQUIT, &savequit, (struct sigaction *)0);
-    sigprocmask(SIG_SETMASK, &saveblock, (sigset_t *)0);
-    */
-
-    /* Disable stdout */
-    if ( dup2(stdoutfd, STDOUT_FILENO) == -1 ) _exit(127);
-    funlockfile(stdout);
-
-    execv(argv[0], argv);
-    /* execl("/bin/sh", "sh", "-c", arg, (char *)0); */
-    _exit(127);
-  }
-  /* UNLOCK io */
-  funlockfile(stdout);
-#if THREADS && !CLIENT_ONLY
-  stat = pthread_mutex_unlock(&GA_iomutex);
-  if ( stat ) { printf("tprintf: mutex_unlock(io): %d\n", stat); exit(1); }
-#endif
-  free(argv);
-
-  if (pid == -1) {
-    printf("invisible_system: fork failed: %s\n", strerror(errno));
-    stat = -1; /* errno comes from fork() */
-  } else {
-    while (waitpid(pid, &stat, 0) == -1) {
-      if (errno != EINTR){
-        stat = -1;
-        printf("invisible_system: waitpid fail: %s\n", strerror(errno));
-        break;
-      }
+
+  if ( ( pid = spawn_redirected(argv, -1, stdoutfd) ) == -1 ) {
+    printf("invisible_system: posix_spawn failed: %s\n", strerror(errno));
+    return -1;
+  }
+  while (waitpid(pid, &stat, 0) == -1) {
+    if (errno != EINTR){
+      stat = -1;
+      printf("invisible_system: waitpid fail: %s\n", strerror(errno));
+      break;
     }
   }
-  //gettimeofday(&endtime, NULL);
-  //printf("System took %f seconds.\n",
-  //       timeval_diff(NULL, &endtime, &starttime)/1000000.0);
-  /*
-  sigaction(SIGINT, &savintr, (struct sigaction *)0);
-  sigaction(SIGQUIT, &savequit, (struct sigaction *)0);
-  sigprocmask(SIG_SETMASK, &saveblock, (sigset_t *)0);
-  */
-
   return(stat);
 }
 #endif
@@ -13,14 +13,35 @@
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
 #include "ga.h"
+/* Vector kernels are compiled with function-level target attributes and
+ * selected at run time, so the rest of the program needs no -m flags. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    ( GA_segment_size == 32 || GA_segment_size == 64 )
+#define GA_SIMD 1
+#include <immintrin.h>
+#endif
 #include "ga.usage.h"
 
 #if THREADS
 static void *GA_do_thread (void * arg);
+static void GA_hybrid_sent(GA_session *session, int nsent);
+static void GA_hybrid_done(GA_session *session, int failed);
+static void GA_hybrid_wait_steals(GA_session *session);
 #endif
 static int GA_rand_init(GA_session *session, unsigned long int seed);
-static int astrcat(char **s, const char *append);
+static int astrcat(char **s, size_t *len, const char *append);
+static void GA_sort_indices(unsigned int *base, size_t n, GA_session *session);
+static int GA_cpu_count(void);
+static void GA_simd_init(void);
+static int GA_thread_remote(const GA_thread *thread);
+#if THREADS && defined(__linux__)
+static int GA_cpu_order(int pinmode, int **cpus);
+#endif
 
 int GA_defaultsettings(GA_settings *settings) {
     memset(settings, 0, sizeof(GA_settings));
@@ -59,6 +80,7 @@ int GA_init(GA_session *session, GA_settings *settings,
             unsigned int segmentcount) {
   unsigned int i, j, rc;
   size_t segmentmallocsize = sizeof(GA_segment)*segmentcount;
+  GA_segment *arena;
 
   if ( !settings->elitismset ) /* Default to sqrt(popsize) */
     settings->elitism = (unsigned)sqrt(settings->popsize);
@@ -84,9 +106,13 @@ int GA_init(GA_session *session, GA_settings *settings,
   qprintf(settings, "SEED %u\n", settings->randomseed);
   if ( GA_rand_init(session, settings->randomseed) != 0 ) return 10;
 
+  /* Select vector kernels for this CPU */
+  GA_simd_init();
+
   /* Set the fields from the parameters */
   session->settings = settings;
   session->fittest = 0;
+  session->threshold = -HUGE_VAL;
   /* Allocate the population array (freed in GA_cleanup) */
   session->population = malloc(sizeof(GA_individual)*settings->popsize);
   if ( !session->population ) return 1;
@@ -95,23 +121,28 @@ int GA_init(GA_session *session, GA_settings *settings,
   /* Allocate and fill the sorted list (freed in GA_cleanup) */
   session->sorted     = malloc(sizeof(unsigned int)*settings->popsize);
   if ( !session->sorted     ) return 3;
+  /* Allocate all segments in one block (freed in GA_cleanup), laid out
+   * as segments and gdsegments of population, then of oldpop. */
+  session->arena = malloc(4*segmentmallocsize*settings->popsize);
+  if ( !session->arena ) return 4;
+  memset(session->arena, 0, 4*segmentmallocsize*settings->popsize);
+  arena = session->arena;
   /* Initialize each individual */
   for ( i = 0; i < settings->popsize; i++ ) {
-    /* Allocate individual's segments (freed in GA_cleanup) */
     memset(&(session->population[i]), 0, sizeof(GA_individual));
     session->population[i].segmentcount = segmentcount;
-    session->population[i].segments = malloc(segmentmallocsize);
-    if ( !session->population[i].segments ) return 4;
-    session->population[i].gdsegments = malloc(segmentmallocsize);
-    if ( !session->population[i].gdsegments ) return 4;
+    session->population[i].segments =
+      arena + segmentcount*i;
+    session->population[i].gdsegments =
+      arena + segmentcount*(settings->popsize+i);
 
-    /* Allocate oldpop element */
+    /* Set up oldpop element */
     memset(&(session->oldpop[i]), 0, sizeof(GA_individual));
     session->oldpop[i].segmentcount = segmentcount;
-    session->oldpop[i].segments = malloc(segmentmallocsize);
-    if ( !session->oldpop[i].segments ) return 5;
-    session->oldpop[i].gdsegments = malloc(segmentmallocsize);
-    if ( !session->oldpop[i].gdsegments ) return 5;
+    session->oldpop[i].segments =
+      arena + segmentcount*(2*settings->popsize+i);
+    session->oldpop[i].gdsegments =
+      arena + segmentcount*(3*settings->popsize+i);
 
     /* Insert into sorted list */
     session->sorted[i] = i;
@@ -150,6 +181,7 @@ int GA_init(GA_session *session, GA_settings *settings,
 #if THREADS
   session->inflag = 0;
   session->outflag = 0;
+  session->shutdown = 0;
 
   /* Initialize mutexes */
   rc = pthread_mutex_init(&(session->inmutex), NULL);
@@ -167,25 +199,84 @@ int GA_init(GA_session *session, GA_settings *settings,
   rc = pthread_mutex_init(&(session->cachemutex), NULL);
   if ( rc ) { qprintf(session->settings,
                       "GA_init: mutex_init(cache): %d\n", rc); exit(1); }
+
+  /* Distributor state (freed in GA_cleanup) */
+  session->pending = NULL;
+  session->remoteround = 0;
+  session->distin = NULL;
+  session->inindex = session->inend = 0; /* No work before the dispatch */
+  session->remoteflag = session->remotebusy = session->remotefailed = 0;
+  session->remotein = session->remotecount = 0;
+  session->remotestart = session->remotedeadline = 0;
+  session->stealindex = settings->popsize;
+  session->stealing = 0;
+  session->remoterate = session->localrate = 0;
+  session->localdone = 0;
+  session->localtime = session->dispatchtime = 0;
+  if ( settings->distbinary ) {
+    session->pending = calloc(settings->popsize, sizeof(unsigned int));
+    if ( !session->pending ) return 5;
+  }
+  if ( settings->disthybrid ) {
+    int fd = dup(fileno(settings->distributor));
+    if ( fd < 0 ) return 56;
+    if ( ( session->distin = fdopen(fd, "r") ) == NULL ) {
+      close(fd);
+      return 56;
+    }
+  }
 #else
   /* No threads supported */
   if ( settings->threadcount > 1 ) return 50; rc = 0;
 #endif
   session->threads = malloc(sizeof(GA_thread)*settings->threadcount);
   if ( !session->threads ) return 51;
-  for ( i = 0; i < session->settings->threadcount; i++ ) {
+#if THREADS && defined(__linux__)
+  /* Determine which CPUs to pin worker threads to */
+  int *cpus = NULL, ncpus = 0;
+  if ( settings->pinmode != GA_PIN_NONE ) {
+    ncpus = GA_cpu_order(settings->pinmode, &cpus);
+    if ( ncpus < 1 )
+      qprintf(settings, "Unable to determine CPUs, threads will not be pinned\n");
+  }
+#endif
+  /* On failure the loop stops with the return code in err, so that cpus
+   * is freed on every path */
+  int err = 0;
+  for ( i = 0; i < session->settings->threadcount && !err; i++ ) {
     int rc = 0;
     session->threads[i].session = session;
     session->threads[i].number = i+1;
+    session->threads[i].ref = NULL;
 #if THREADS
-    if ( pthread_create (&session->threads[i].threadid, NULL,
-                         GA_do_thread, (void *)&(session->threads[i])) != 0 ) {
-      return 51;
+    pthread_attr_t attr;
+    if ( pthread_attr_init(&attr) != 0 ) { err = 51; break; }
+#ifdef __linux__
+    if ( ncpus > 0 ) {
+      /* Processes started by the thread (e.g. SPCAT) inherit its affinity. */
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpus[i % ncpus], &set);
+      rc = pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+      if ( rc ) qprintf(settings, "GA_init: setaffinity: %d\n", rc);
+      else lprintf(settings, "Pinning thread %u to CPU %d\n", i+1,
+                   cpus[i % ncpus]);
     }
 #endif
+    rc = pthread_create(&session->threads[i].threadid, &attr,
+                        GA_do_thread, (void *)&(session->threads[i]));
+    pthread_attr_destroy(&attr);
+    if ( rc != 0 ) { err = 51; break; }
+#endif
+    /* A thread that only talks to the distributor needs no SPCAT etc. */
+    if ( GA_thread_remote(&session->threads[i]) ) continue;
     rc = GA_thread_init(&session->threads[i]);
-    if ( rc != 0 ) return 55;
+    if ( rc != 0 ) err = 55;
   }
+#if THREADS && defined(__linux__)
+  free(cpus);
+#endif
+  if ( err ) return err;
   /* Evaluate final fitness for each individual */
   session->generation = 0;
   if ( GA_starting_generation(session) != 0 ) return 89;
@@ -197,16 +288,37 @@ int GA_init(GA_session *session, GA_settings *settings,
 int GA_cleanup(GA_session *session) {
   unsigned int i, j;
   /* qprintf(session->settings, "RNDB %u\n", GA_rand(session)); */
+#if THREADS
+  /* Stop the worker threads */
+  int rc = pthread_mutex_lock(&(session->inmutex));
+  if ( rc ) { qprintf(session->settings,
+                      "GA_cleanup: mutex_lock(in): %d\n", rc); exit(1); }
+  session->shutdown = 1;
+  pthread_cond_broadcast(&(session->incond));
+  pthread_mutex_unlock(&(session->inmutex));
+  /* In hybrid mode, the first thread may still be waiting for a round the
+   * local threads finished. End its read rather than wait for the
+   * distributor. */
+  if ( session->settings->disthybrid )
+    shutdown(fileno(session->settings->distributor), SHUT_RD);
   for ( i = 0; i < session->settings->threadcount; i++ ) {
-    GA_thread_free(&session->threads[i]);
+    rc = pthread_join(session->threads[i].threadid, NULL);
+    if ( rc ) qprintf(session->settings, "GA_cleanup: join: %d\n", rc);
   }
-  free(session->threads);
-  for ( i = 0; i < session->settings->popsize; i++ ) {
-    free(session->population[i].segments);
-    free(session->population[i].gdsegments);
-    free(session->oldpop[i].segments);
-    free(session->oldpop[i].gdsegments);
+  pthread_mutex_destroy(&(session->inmutex));
+  pthread_mutex_destroy(&(session->outmutex));
+  pthread_mutex_destroy(&(session->cachemutex));
+  pthread_cond_destroy(&(session->incond));
+  pthread_cond_destroy(&(session->outcond));
+  free(session->pending);
+  if ( session->distin ) fclose(session->distin);
+#endif
+  for ( i = 0; i < session->settings->threadcount; i++ ) {
+    if ( !GA_thread_remote(&session->threads[i]) )
+      GA_thread_free(&session->threads[i]);
   }
+  free(session->threads);
+  free(session->arena);
   free(session->population);
   free(session->oldpop);
   free(session->sorted);
@@ -216,6 +328,9 @@ int GA_cleanup(GA_session *session) {
   }
   if ( session->fitnesscache ) free(session->fitnesscache);
   free(session->dynmut_trailing);
+#if HAVE_GSL
+  gsl_rng_free(session->r);
+#endif
   return 0;
 }
 
@@ -237,14 +352,13 @@ int GA_evolve(GA_session *session, unsigned int generations) {
 
     /* Keep top 8 members of the old population. */
     for ( i = 0; i < session->settings->elitism; i++ ) {
-      unsigned int j;
-      for ( j = 0; j < session->population[i].segmentcount; j++ ) {
-        /* Insert new segments */
-        session->population[i].segments[j] =
-            session->oldpop[session->sorted[i]].segments[j];
-        session->population[i].gdsegments[j] =
-            session->oldpop[session->sorted[i]].gdsegments[j];
-      }
+      /* Insert new segments */
+      memcpy(session->population[i].segments,
+             session->oldpop[session->sorted[i]].segments,
+             sizeof(GA_segment)*session->population[i].segmentcount);
+      memcpy(session->population[i].gdsegments,
+             session->oldpop[session->sorted[i]].gdsegments,
+             sizeof(GA_segment)*session->population[i].segmentcount);
     }
     /* Create a new population by roulette wheel.
        (Consider: Top half roulette wheel/Keep top 8?) */
@@ -273,7 +387,14 @@ int GA_evolve(GA_session *session, unsigned int generations) {
 }
 
 void GA_generate(GA_session *session, unsigned int i) {
-  unsigned int ntimes = 0;
+  unsigned int ntimes = 0, bitpos;
+  /* Mutation probability of each bit position. Computed once per call
+   * (the mutation rate only changes between generations). */
+  double threshold[GA_segment_size];
+  for ( bitpos = 0; bitpos < GA_segment_size; bitpos++ )
+    threshold[bitpos] = session->settings->mutationrate *
+      powf((double)(GA_segment_size-bitpos)/GA_segment_size,
+           session->settings->mutationweight);
   for ( ; i < session->settings->popsize; /* See bottom of loop */ ) {
     unsigned int a, b, j;
     /* Special case first generation (required to allow regeneration of
@@ -287,6 +408,8 @@ void GA_generate(GA_session *session, unsigned int i) {
           session->population[i].gdsegments[j] = graydecode(r);
         }
         session->population[i].fitness = 0;
+        if ( session->settings->repair )
+          GA_repair(session, &session->population[i]);
       } while ( !GA_fitness_quick(session, &session->population[i]) );
       i++;
       continue;
@@ -296,8 +419,9 @@ void GA_generate(GA_session *session, unsigned int i) {
     b = GA_roulette(session);
     for ( j = 0; j < session->population[i].segmentcount; j++ ) {
       int afirst = GA_rand(session) % 2;
-      int bitpos = GA_rand(session) % GA_segment_size;
-      GA_segment mask = (1<<bitpos)-1;
+      GA_segment mask;
+      bitpos = GA_rand(session) % GA_segment_size;
+      mask = ((GA_segment)1<<bitpos)-1;
       /* Crossover. Random split & recombine. */
       GA_segment olda = session->oldpop[afirst ? a : b].segments[j];
       GA_segment oldb = session->oldpop[afirst ? b : a].segments[j];
@@ -314,13 +438,10 @@ void GA_generate(GA_session *session, unsigned int i) {
       /* Mutation. Low-probability bitflip. */
       for ( bitpos = 0; bitpos < GA_segment_size; bitpos++ ) {
         unsigned int k;
-        mask = 1<<bitpos;
+        mask = (GA_segment)1<<bitpos;
         for ( k = 0; k < 2; k++ ) { /* Outer loop is pairwise */
-          double threshold = session->settings->mutationrate *
-            powf((double)(GA_segment_size-bitpos)/GA_segment_size,
-                 session->settings->mutationweight);
           /* Mutation probability */
-          if ( GA_rand_double(session) >= threshold ) continue;
+          if ( GA_rand_double(session) >= threshold[bitpos] ) continue;
           /* printf("FLIP %08x     ", (k == 0) ? newa : newb); */
           if ( k == 0 ) newa ^= mask;
           else newb ^= mask;
@@ -329,17 +450,26 @@ void GA_generate(GA_session *session, unsigned int i) {
                  (k == 0) ? newa : newb, bitpos, mask); */
         }
       }
-      /* Insert new segments. Graydecode each segment and store the
-       * result in the graydecode cache. This allows us to graydecode
-       * each segment only once. */
-
+      /* Insert new segments. */
       session->population[i].segments[j] = newa;
-      session->population[i].gdsegments[j] = graydecode(newa);
-      if ( i+1 < session->settings->popsize ) {
+      if ( i+1 < session->settings->popsize )
         session->population[i+1].segments[j] = newb;
-        session->population[i+1].gdsegments[j] = graydecode(newb);
-        //printf("%d\n", graydecode(newa));
-      }
+    }
+    /* Graydecode each new individual in one pass and store the result in
+     * the graydecode cache. This allows us to graydecode each segment
+     * only once. */
+    GA_graydecode_array(session->population[i].gdsegments,
+                        session->population[i].segments,
+                        session->population[i].segmentcount);
+    if ( i+1 < session->settings->popsize )
+      GA_graydecode_array(session->population[i+1].gdsegments,
+                          session->population[i+1].segments,
+                          session->population[i+1].segmentcount);
+    /* Project new population elements onto the valid region */
+    if ( session->settings->repair ) {
+      GA_repair(session, &session->population[i]);
+      if ( i+1 < session->settings->popsize )
+        GA_repair(session, &session->population[i+1]);
     }
     /* Verify that new population elements are valid */
     if ( GA_fitness_quick(session, &session->population[i]) &&
@@ -378,15 +508,9 @@ unsigned int GA_roulette(GA_session *session) {
   return 0;
 }
 
-int GA_comparator(const void *a, const void *b) {
-  /* Static variable used to hold session, neccessary due to qsort's
-     calling convention */
-  static GA_session *session;
-  if ( a && !b ) {
-    session = (GA_session *)a;
-    return 0;
-  }
-  else if ( !session || !a || !b ) return 0;
+int GA_comparator(const void *a, const void *b, void *arg) {
+  const GA_session *session = (const GA_session *)arg;
+  if ( !session || !a || !b ) return 0;
   int x = *(unsigned int *)a, y = *(unsigned int *)b;
   if ( session->population[x].fitness < session->population[y].fitness )
     return 1;
@@ -430,15 +554,22 @@ static void GA_cache_fitness(GA_session *session, unsigned int i,
 }
 
 static unsigned int GA_hash_individual(GA_session *session, unsigned int i) {
-  GA_segment hashtemp = 0;
-  int j;
+  GA_segment hashtemp;
   if ( !session->fitnesscache ) return 0;
 
-  for ( j = 0; j < session->population[i].segmentcount; j++ )
-    hashtemp ^= session->population[i].segments[j];
+  hashtemp = GA_segments_xor(session->population[i].segments,
+                             session->population[i].segmentcount);
   return hashtemp % session->cachesize;
 }
 
+/* Does the thread only send individuals to the distributor? With
+ * disthybrid, only the first thread does; the others evaluate locally. */
+static int GA_thread_remote(const GA_thread *thread) {
+  const GA_settings *settings = thread->session->settings;
+  return settings->distributor &&
+    ( !settings->disthybrid || thread->number == 1 );
+}
+
 static int GA_do_checkfitness(GA_thread *thread, unsigned int i) {
   GA_session *session = thread->session;
   int j;
@@ -458,9 +589,9 @@ static int GA_do_checkfitness(GA_thread *thread, unsigned int i) {
 #endif
     for ( j = 0; j < 2; j++ ) {
       if ( ( session->fitnesscache[hashbucket][j].unscaledfitness != 0 ) &&
-           !memcmp(session->population[i].segments,
-                   session->fitnesscache[hashbucket][j].segments,
-                   sizeof(GA_segment)*session->population[i].segmentcount) ) {
+           GA_segments_equal(session->population[i].segments,
+                             session->fitnesscache[hashbucket][j].segments,
+                             session->population[i].segmentcount) ) {
         session->population[i].fitness =
           session->fitnesscache[hashbucket][j].fitness;
         found = 1 + j;
@@ -478,9 +609,9 @@ static int GA_do_checkfitness(GA_thread *thread, unsigned int i) {
      * oldpop only modified in GA_evolve */
     if ( !found && session->generation > 0 ) {
       for ( j = 0; j < session->settings->popsize; j++ ) {
-        if ( !memcmp(session->population[i].segments,
-                     session->oldpop[j].segments,
-                     sizeof(GA_segment)*session->population[i].segmentcount) ) {
+        if ( GA_segments_equal(session->population[i].segments,
+                               session->oldpop[j].segments,
+                               session->population[i].segmentcount) ) {
           session->population[i].fitness = session->oldpop[j].unscaledfitness;
           found = 6;
           break;
@@ -493,11 +624,12 @@ static int GA_do_checkfitness(GA_thread *thread, unsigned int i) {
   /* memcpy(&founditem, &(session->population[i]), sizeof(GA_individual)); */
   if ( !found ) {
     int rc = 0;
-    if ( session->settings->distributor ) return 0;
+    /* Left to the distributor */
+    if ( GA_thread_remote(thread) ) return 0;
     if ( ((rc = GA_fitness(session, thread->ref, /* FIXME */
                            &session->population[i])) != 0)
          /* || isnan(session->population[i].fitness) */ ) { /* nan okay now */
-      qprintf(session->settings, "fitness error %u %f => %d\n",
+      qprintf(session->settings, "fitness error %" GA_PRIu " %f => %d\n",
               session->population[i].segments[0],
               session->population[i].fitness, rc);
       return 51;
@@ -527,6 +659,78 @@ static int GA_do_checkfitness(GA_thread *thread, unsigned int i) {
   return found;
 }
 
+/* Framing for the binary distributor protocol (see GA_DIST_VERSION) */
+static void GA_put_u32(unsigned char *p, uint32_t v) {
+  p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static uint32_t GA_get_u32(const unsigned char *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+         (uint32_t)p[2] << 8 | p[3];
+}
+
+#if GA_segment_size > 32
+static void GA_put_u64(unsigned char *p, uint64_t v) {
+  GA_put_u32(p, v >> 32); GA_put_u32(p+4, (uint32_t)v);
+}
+#endif
+
+static uint64_t GA_get_u64(const unsigned char *p) {
+  return (uint64_t)GA_get_u32(p) << 32 | GA_get_u32(p+4);
+}
+
+static int GA_dist_write_frame(FILE *fh, int type, const unsigned char *payload,
+                               size_t len) {
+  unsigned char header[5];
+  int rc = 0;
+  GA_put_u32(header, len+1);
+  header[4] = type;
+  /* In hybrid mode, the main thread and the distributor thread write */
+  flockfile(fh);
+  if ( fwrite(header, 1, 5, fh) != 5 ||
+       ( len > 0 && fwrite(payload, 1, len, fh) != len ) ) rc = -1;
+  funlockfile(fh);
+  return rc;
+}
+
+/* Read a frame into *buf (grown as necessary). Returns its type, with
+ * the payload in (*buf)[1..*len), or -1 on error or EOF. */
+static int GA_dist_read_frame(FILE *fh, unsigned char **buf, size_t *size,
+                              size_t *len) {
+  unsigned char header[4];
+  uint32_t n;
+  if ( fread(header, 1, 4, fh) != 4 ) return -1;
+  n = GA_get_u32(header);
+  if ( n < 1 || n > GA_DIST_MAXFRAME ) { errno = EPROTO; return -1; }
+  if ( n > *size ) {
+    unsigned char *nbuf = realloc(*buf, n);
+    if ( !nbuf ) return -1;
+    *buf = nbuf;
+    *size = n;
+  }
+  if ( fread(*buf, 1, n, fh) != n ) return -1;
+  *len = n;
+  return (*buf)[0];
+}
+
+int GA_distributor_printf(GA_settings *settings, const char *format, ...) {
+  va_list ap;
+  char *str = NULL;
+  int rc;
+  va_start(ap, format);
+  rc = vasprintf(&str, format, ap);
+  va_end(ap);
+  if ( rc < 0 ) return rc;
+  if ( settings->distbinary ) {
+    if ( GA_dist_write_frame(settings->distributor, GA_DIST_TEXT,
+                             (unsigned char *)str, rc) ) rc = -1;
+  }
+  else if ( fputs(str, settings->distributor) == EOF ) rc = -1;
+  if ( fflush(settings->distributor) ) rc = -1;
+  free(str);
+  return rc;
+}
+
 #if THREADS
 static void thread_send_result(GA_session *session, int in, int found) {
   /* Return the result to main program */
@@ -553,11 +757,435 @@ static void thread_send_result(GA_session *session, int in, int found) {
   /* printf("Output completed\n"); */
 }
 
+/* Return the fitness of individual i, pending in distributor round
+ * round, unless another thread already returned it. found is as for
+ * thread_send_result. Returns 0 if this result was too late. */
+static int thread_send_first(GA_session *session, int i, unsigned int round,
+                             double fitness, int found) {
+  int rc = pthread_mutex_lock(&(session->outmutex));
+  if ( rc ) { qprintf(session->settings,
+                "thread_send_first: mutex_lock(out): %d\n", rc); exit(1); }
+  if ( session->pending[i] != round ) {
+    pthread_mutex_unlock(&(session->outmutex));
+    return 0;
+  }
+  session->pending[i] = 0;
+  session->population[i].fitness = fitness;
+  rc = pthread_mutex_unlock(&(session->outmutex));
+  if ( rc ) { qprintf(session->settings,
+                "thread_send_first: mutex_unlock(out): %d\n", rc); exit(1); }
+  /* The main thread cannot move on before this result is sent */
+  if ( !found ) GA_cache_fitness(session, i, GA_hash_individual(session, i));
+  thread_send_result(session, i, found);
+  return 1;
+}
+
+/* Result code a distributor thread sends the main thread (as for
+ * GA_do_checkfitness) when the distributor fails, to stop the run */
+#define GA_DIST_FAILED 53
+
+/* Individuals per GA_DIST_ITEMS frame. The distributor can start on a
+ * frame while the next one is being checked against the cache. */
+#define GA_DIST_BATCH 256
+
+/* Send the individuals in..last-1 that are not cached to the distributor,
+ * in batches, using buf (big enough for a batch) as scratch space.
+ * Returns the number sent, or -1 on error. */
+static int GA_dist_send(GA_thread *thread, unsigned int generation,
+                        unsigned int round, unsigned int in,
+                        unsigned int last, unsigned char *buf) {
+  GA_session *session = thread->session;
+  FILE *fh = session->settings->distributor;
+  const unsigned int nseg = session->population[in].segmentcount;
+  unsigned char *p = buf+12;
+  unsigned int i, j, nbatch = 0;
+  int found, nsent = 0;
+  for ( i = in; i < last; i++ ) {
+    if ( ( found = GA_do_checkfitness(thread, i) ) != 0 ) {
+      /* Found in cache */
+      thread_send_first(session, i, round, session->population[i].fitness,
+                        found);
+      continue;
+    }
+    GA_put_u32(p, i);
+    p += 4;
+    for ( j = 0; j < nseg; j++, p += GA_segment_size/8 ) {
+#if GA_segment_size > 32
+      GA_put_u64(p, session->population[i].gdsegments[j]);
+#else
+      GA_put_u32(p, session->population[i].gdsegments[j]);
+#endif
+    }
+    nsent++;
+    if ( ++nbatch == GA_DIST_BATCH ) {
+      GA_put_u32(buf, generation);
+      GA_put_u32(buf+4, nseg);
+      GA_put_u32(buf+8, GA_segment_size/8);
+      if ( GA_dist_write_frame(fh, GA_DIST_ITEMS, buf, p-buf) ) return -1;
+      p = buf+12;
+      nbatch = 0;
+    }
+  }
+  if ( nbatch > 0 ) {
+    GA_put_u32(buf, generation);
+    GA_put_u32(buf+4, nseg);
+    GA_put_u32(buf+8, GA_segment_size/8);
+    if ( GA_dist_write_frame(fh, GA_DIST_ITEMS, buf, p-buf) ) return -1;
+  }
+  GA_put_u32(buf, generation);
+  GA_put_u32(buf+4, nsent);
+  if ( GA_dist_write_frame(fh, GA_DIST_DISPATCH, buf, 8) || fflush(fh) )
+    return -1;
+  return nsent;
+}
+
+/* Has GA_cleanup started stopping the threads? */
+static int GA_shutting_down(GA_session *session) {
+  int stopping;
+  int rc = pthread_mutex_lock(&(session->inmutex));
+  if ( rc ) { qprintf(session->settings,
+                "GA_shutting_down: mutex_lock(in): %d\n", rc); exit(1); }
+  stopping = session->shutdown;
+  pthread_mutex_unlock(&(session->inmutex));
+  return stopping;
+}
+
+/* Read results from the distributor, in any order and batching, until
+ * the generation is done. received flags the individuals in..last-1 that
+ * have a result. The last result is not passed on but returned in
+ * *lastindex and *lastfitness, so that the main thread cannot start the
+ * next generation (and write to the distributor) before DONE has been
+ * read. Returns 0 on success. */
+static int GA_dist_receive(GA_session *session, unsigned int generation,
+                           unsigned int round, unsigned int in,
+                           unsigned int last, unsigned int nexpected,
+                           unsigned char **buf, size_t *size,
+                           char *received, unsigned int *lastindex,
+                           double *lastfitness) {
+  GA_settings *settings = session->settings;
+  FILE *fh = session->distin ? session->distin : settings->distributor;
+  unsigned int nreceived = 0;
+  while ( 1 ) {
+    const unsigned char *p;
+    size_t len;
+    int type = GA_dist_read_frame(fh, buf, size, &len);
+    if ( type < 0 ) {
+      /* GA_cleanup ends the read of an unfinished hybrid round */
+      if ( !GA_shutting_down(session) )
+        qprintf(settings, "Read error from distributor: %s\n",
+                strerror(errno));
+      return 1;
+    }
+    if ( len < 5 || GA_get_u32(*buf+1) != generation ) {
+      qprintf(settings, "Frame '%c' for another generation from distributor\n",
+              type);
+      return 1;
+    }
+    if ( type == GA_DIST_DONE ) {
+      if ( nreceived == nexpected ) return 0;
+      qprintf(settings, "Premature DONE from distributor\n");
+      return 1;
+    }
+    if ( type != GA_DIST_RESULTS || (len-5) % 12 != 0 ) {
+      qprintf(settings, "Can't parse frame '%c' from distributor\n", type);
+      return 1;
+    }
+    for ( p = *buf+5; p < *buf+len; p += 12 ) {
+      unsigned int index = GA_get_u32(p);
+      uint64_t bits = GA_get_u64(p+4);
+      double fitness;
+      if ( index < in || index >= last || received[index-in] ||
+           nreceived == nexpected ) {
+        qprintf(settings, "Invalid index %u from distributor\n", index);
+        return 1;
+      }
+      received[index-in] = 1;
+      memcpy(&fitness, &bits, sizeof(double));
+      if ( ++nreceived == nexpected ) {
+        *lastindex = index;
+        *lastfitness = fitness;
+      }
+      else thread_send_first(session, index, round, fitness, 0);
+    }
+  }
+}
+
+/* Mark individuals in..last-1 as pending in distributor round round */
+static void GA_dist_pending(GA_session *session, unsigned int in,
+                            unsigned int last, unsigned int round) {
+  unsigned int i;
+  int rc = pthread_mutex_lock(&(session->outmutex));
+  if ( rc ) { qprintf(session->settings,
+                "GA_dist_pending: mutex_lock(out): %d\n", rc); exit(1); }
+  for ( i = in; i < last; i++ ) session->pending[i] = round;
+  pthread_mutex_unlock(&(session->outmutex));
+}
+
+/* Evaluate individuals in..last-1 through the distributor, using the
+ * binary protocol. Returns 0 on success. */
+static int GA_dist_evaluate(GA_thread *thread, unsigned int in,
+                            unsigned int last, unsigned int round) {
+  GA_session *session = thread->session;
+  /* In hybrid mode, the main thread may start the next generation before
+   * this round is done */
+  const unsigned int generation = session->generation;
+  size_t size = 12+GA_DIST_BATCH*
+    (4+session->population[in].segmentcount*GA_segment_size/8);
+  unsigned char *buf;
+  char *received;
+  int nsent = 0, rc = 1;
+  unsigned int lastindex = 0;
+  double lastfitness = 0;
+  GA_dist_pending(session, in, last, round);
+  buf = malloc(size);
+  received = calloc(last-in, 1);
+  if ( !buf || !received )
+    qprintf(session->settings, "Out of memory (distributor)\n");
+  else if ( ( nsent = GA_dist_send(thread, generation, round, in, last,
+                                   buf) ) < 0 )
+    qprintf(session->settings, "Write error to distributor: %s\n",
+            strerror(errno));
+  else {
+    if ( session->settings->disthybrid ) GA_hybrid_sent(session, nsent);
+    rc = GA_dist_receive(session, generation, round, in, last, nsent,
+                         &buf, &size, received, &lastindex, &lastfitness);
+  }
+  free(buf);
+  free(received);
+  if ( session->settings->disthybrid ) GA_hybrid_done(session, rc);
+  if ( rc == 0 && nsent > 0 )
+    thread_send_first(session, lastindex, round, lastfitness, 0);
+  return rc;
+}
+
+/* Hybrid mode (GA_settings.disthybrid): each dispatch is split between
+ * the local threads and the first thread, which sends its share to the
+ * distributor, in proportion to how fast each has been. Once its deadline
+ * passes, idle local threads also evaluate individuals that are still
+ * pending at the distributor, and whichever result comes first is used. */
+
+/* Deadline (seconds) until the distributor's speed is known */
+#define GA_HYBRID_DEADLINE 30.0
+
+static double GA_now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec/1e6;
+}
+
+/* Split individuals first..popsize-1 between the local threads and the
+ * distributor (inmutex held) */
+static void GA_hybrid_dispatch(GA_session *session, int first) {
+  const int n = session->settings->popsize - first;
+  int nremote = 0;
+  /* Throughput of the local threads in the previous dispatch */
+  if ( session->localdone > 0 && session->localtime > session->dispatchtime )
+    session->localrate = session->localdone/
+      (session->localtime - session->dispatchtime);
+  session->localdone = 0;
+  session->dispatchtime = GA_now();
+  /* A distributor still busy with an earlier round gets nothing */
+  if ( !session->remotebusy && !session->remotefailed && n > 0 ) {
+    double share = 0.5;
+    if ( session->remoterate > 0 && session->localrate > 0 )
+      share = session->remoterate/(session->remoterate+session->localrate);
+    nremote = (int)(share*n + 0.5);
+    if ( nremote < 1 ) nremote = 1; /* Keep measuring the distributor */
+  }
+  session->inend = session->settings->popsize - nremote;
+  session->remotein = session->inend;
+  session->remoteflag = ( nremote > 0 );
+  lprintf(session->settings, "HYBR %03u local %d remote %d\n",
+          session->generation, n - nremote, nremote);
+}
+
+/* The distributor's share has been sent: set its deadline and wake the
+ * local threads */
+static void GA_hybrid_sent(GA_session *session, int nsent) {
+  double deadline = session->settings->distdeadline;
+  int rc;
+  if ( deadline <= 0 ) { /* Twice the expected time */
+    if ( session->remoterate > 0 ) deadline = 2*nsent/session->remoterate;
+    else deadline = GA_HYBRID_DEADLINE;
+    if ( deadline < 1 ) deadline = 1;
+  }
+  rc = pthread_mutex_lock(&(session->inmutex));
+  if ( rc ) { qprintf(session->settings,
+                "GA_hybrid_sent: mutex_lock(in): %d\n", rc); exit(1); }
+  session->remotecount = nsent;
+  session->remotestart = GA_now();
+  session->remotedeadline = session->remotestart + deadline;
+  pthread_cond_broadcast(&(session->incond));
+  pthread_mutex_unlock(&(session->inmutex));
+}
+
+/* The distributor's round is over: measure its throughput or, if it
+ * failed, leave its pending individuals to the local threads */
+static void GA_hybrid_done(GA_session *session, int failed) {
+  int rc = pthread_mutex_lock(&(session->inmutex));
+  if ( rc ) { qprintf(session->settings,
+                "GA_hybrid_done: mutex_lock(in): %d\n", rc); exit(1); }
+  session->remotebusy = 0;
+  if ( failed && session->shutdown ) ; /* Read ended by GA_cleanup */
+  else if ( failed ) {
+    qprintf(session->settings, "Distributor failed, evaluating locally\n");
+    session->remotefailed = 1;
+    session->remotedeadline = GA_now();
+    pthread_cond_broadcast(&(session->incond));
+  }
+  else {
+    if ( session->remotecount > 0 )
+      session->remoterate = session->remotecount/
+        (GA_now() - session->remotestart);
+    session->remotedeadline = 0;
+  }
+  pthread_mutex_unlock(&(session->inmutex));
+}
+
+/* Is individual i still pending in distributor round round? */
+static int GA_is_pending(GA_session *session, int i, unsigned int round) {
+  int pending;
+  int rc = pthread_mutex_lock(&(session->outmutex));
+  if ( rc ) { qprintf(session->settings,
+                "GA_is_pending: mutex_lock(out): %d\n", rc); exit(1); }
+  pending = ( session->pending[i] == round );
+  pthread_mutex_unlock(&(session->outmutex));
+  return pending;
+}
+
+/* Find work for a local thread (inmutex held): the next individual of the
+ * local share or, after the deadline, an individual still pending at the
+ * distributor. Returns 0 if there is none. */
+static int GA_hybrid_claim(GA_session *session, int *in, int *steal,
+                           unsigned int *round) {
+  if ( session->inindex < session->inend ) {
+    *in = session->inindex++;
+    *steal = 0;
+    return 1;
+  }
+  if ( session->remotedeadline <= 0 || GA_now() < session->remotedeadline )
+    return 0;
+  while ( session->stealindex < (int)session->settings->popsize ) {
+    int i = session->stealindex++;
+    if ( GA_is_pending(session, i, session->remoteround) ) {
+      *in = i;
+      *steal = 1;
+      *round = session->remoteround;
+      session->stealing++;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Wait until no overdue individual is being evaluated locally. Called by
+ * the main thread before it moves on from a dispatch: the losing copies
+ * of a round are still in GA_fitness, which reads session state (the
+ * observation bins, threshold) that the next generation changes. */
+static void GA_hybrid_wait_steals(GA_session *session) {
+  int rc = pthread_mutex_lock(&(session->inmutex));
+  if ( rc ) { qprintf(session->settings,
+                "GA_hybrid_wait_steals: mutex_lock(in): %d\n", rc); exit(1); }
+  while ( session->stealing > 0 ) {
+    rc = pthread_cond_wait(&(session->incond), &(session->inmutex));
+    if ( rc ) { qprintf(session->settings,
+                  "GA_hybrid_wait_steals: cond_wait(in): %d\n", rc); exit(1); }
+  }
+  pthread_mutex_unlock(&(session->inmutex));
+}
+
+/* Evaluate individual i, overdue at the distributor in round round. A
+ * copy is evaluated, so a result from the distributor can still win. */
+static void GA_hybrid_steal(GA_thread *thread, int i, unsigned int round) {
+  GA_session *session = thread->session;
+  GA_individual copy = session->population[i];
+  size_t size = sizeof(GA_segment)*copy.segmentcount;
+  GA_segment *segments = malloc(2*size);
+  if ( !segments ) return; /* Leave it to the distributor */
+  copy.segments = memcpy(segments, session->population[i].segments, size);
+  copy.gdsegments = memcpy(segments+copy.segmentcount,
+                           session->population[i].gdsegments, size);
+  if ( GA_fitness(session, thread->ref, &copy) == 0 &&
+       thread_send_first(session, i, round, copy.fitness, 0) )
+    lprintf(session->settings, "Individual %d overdue at distributor, "
+            "evaluated locally\n", i);
+  free(segments);
+}
+
+/* Worker thread in hybrid mode */
+static void *GA_hybrid_thread(GA_thread *thread) {
+  GA_session *session = thread->session;
+  const int remote = ( thread->number == 1 );
+  while ( 1 ) {
+    int in = 0, last = 0, steal = 0, found;
+    unsigned int round = 0;
+    int rc = pthread_mutex_lock(&(session->inmutex));
+    if ( rc ) { qprintf(session->settings,
+                  "GA_hybrid_thread: mutex_lock(in): %d\n", rc); exit(1); }
+    while ( !session->shutdown ) {
+      if ( remote ? session->remoteflag :
+           GA_hybrid_claim(session, &in, &steal, &round) ) break;
+      if ( !remote && session->remotedeadline > 0 &&
+           session->stealindex < (int)session->settings->popsize ) {
+        /* Wait for the deadline */
+        struct timespec ts;
+        ts.tv_sec = (time_t)session->remotedeadline;
+        ts.tv_nsec = (long)((session->remotedeadline - ts.tv_sec)*1e9);
+        rc = pthread_cond_timedwait(&(session->incond), &(session->inmutex),
+                                    &ts);
+        if ( rc == ETIMEDOUT ) rc = 0;
+      }
+      else rc = pthread_cond_wait(&(session->incond), &(session->inmutex));
+      if ( rc ) { qprintf(session->settings,
+                    "GA_hybrid_thread: cond_wait(in): %d\n", rc); exit(1); }
+    }
+    if ( session->shutdown ) {
+      pthread_mutex_unlock(&(session->inmutex));
+      return NULL;
+    }
+    if ( remote ) {
+      in = session->remotein;
+      last = session->settings->popsize;
+      round = ++session->remoteround;
+      session->remoteflag = 0;
+      session->remotebusy = 1;
+      session->stealindex = in;
+    }
+    pthread_mutex_unlock(&(session->inmutex));
+
+    if ( remote ) {
+      if ( GA_dist_evaluate(thread, in, last, round) ) return NULL;
+    }
+    else if ( steal ) {
+      GA_hybrid_steal(thread, in, round);
+      rc = pthread_mutex_lock(&(session->inmutex));
+      if ( rc ) { qprintf(session->settings,
+                    "GA_hybrid_thread: mutex_lock(in): %d\n", rc); exit(1); }
+      /* The main thread waits on incond for the last steal */
+      if ( --session->stealing == 0 )
+        pthread_cond_broadcast(&(session->incond));
+      pthread_mutex_unlock(&(session->inmutex));
+    }
+    else {
+      found = GA_do_checkfitness(thread, in);
+      rc = pthread_mutex_lock(&(session->inmutex));
+      if ( rc ) { qprintf(session->settings,
+                    "GA_hybrid_thread: mutex_lock(in): %d\n", rc); exit(1); }
+      session->localdone++;
+      session->localtime = GA_now();
+      pthread_mutex_unlock(&(session->inmutex));
+      thread_send_result(session, in, found);
+    }
+  }
+}
+
 static void *GA_do_thread (void * arg) {
   GA_thread *thread = (GA_thread *)arg;
   GA_session *session = thread->session;
+  if ( session->settings->disthybrid ) return GA_hybrid_thread(thread);
   while ( 1 ) {
     int in, found, last;
+    unsigned int round = 0;
     int rc;
 
     /* Find a job to process */
@@ -566,17 +1194,25 @@ static void *GA_do_thread (void * arg) {
     if ( rc ) { qprintf(session->settings,
                         "GA_do_thread: mutex_lock(in): %d\n", rc); exit(1); }
     /* Wait until the job-available flag is set */
-    while ( !(session->inflag) ) {
+    while ( !(session->inflag) && !(session->shutdown) ) {
       /* printf("Waiting for cond...\n"); */
       rc = pthread_cond_wait(&(session->incond), &(session->inmutex));
       if ( rc ) { qprintf(session->settings,
                           "GA_do_thread: cond_wait(in): %d\n", rc); exit(1); }
     }
+    /* Session is being cleaned up */
+    if ( session->shutdown ) {
+      pthread_mutex_unlock(&(session->inmutex));
+      return NULL;
+    }
     in = session->inindex;      /* We got data to process! */
 
     /* In distributed mode, we'll handle the entire population in this
      * thread. */
-    if ( session->settings->distributor ) last = session->settings->popsize;
+    if ( session->settings->distributor ) {
+      last = session->settings->popsize;
+      round = ++session->remoteround;
+    }
     else last = in + 1;
     session->inindex = last;
 
@@ -593,8 +1229,15 @@ static void *GA_do_thread (void * arg) {
                         "GA_do_thread: mutex_unlock(in): %d\n", rc); exit(1); }
 
     /* Process item or items */
-    if ( session->settings->distributor ) {
+    if ( session->settings->distributor && session->settings->distbinary ) {
+      if ( GA_dist_evaluate(thread, in, last, round) ) {
+        thread_send_result(session, in, GA_DIST_FAILED);
+        return NULL;
+      }
+    }
+    else if ( session->settings->distributor ) {
       unsigned int i, index, nexpected = 0;
+      int failed = 1;
       /* Check caches and send individuals to the distributor */
       for ( i = in; i < last; i++ ) {
         if ( ( found = GA_do_checkfitness(thread, i) ) != 0 ) {
@@ -605,7 +1248,7 @@ static void *GA_do_thread (void * arg) {
           unsigned int j;
           fprintf(session->settings->distributor, "I %u", i);
           for ( j = 0; j < session->population[i].segmentcount; j++ ) {
-            fprintf(session->settings->distributor, " %x",
+            fprintf(session->settings->distributor, " %" GA_PRIx,
                     session->population[i].gdsegments[j]);
           }
           fprintf(session->settings->distributor, "\n");
@@ -625,34 +1268,38 @@ static void *GA_do_thread (void * arg) {
         if ( fgets(line, 1024, session->settings->distributor) == NULL ) {
           qprintf(session->settings, "Read error from distributor: %s\n",
                   strerror(errno));
-          return NULL;
+          break;
         }
         //printf("  %s  at i=%u/%u\n", line, i, nexpected);
         /* DONE signal */
         if ( strncmp(line, "DONE", 4) == 0 ) {
-          if ( i == nexpected ) break;
-          qprintf(session->settings, "Premature DONE from distributor\n");
-          return NULL;
+          if ( i == nexpected ) failed = 0;
+          else qprintf(session->settings, "Premature DONE from distributor\n");
+          break;
         }
         /* Prevent overflow */
         if ( i >= nexpected ) {
           qprintf(session->settings, "Didn't recieve DONE from distributor\n");
-          return NULL;
+          break;
         }
         /* Parse message */
         if ( sscanf(line, "F %u %lf", &index, &fitness) != 2 ) {
           qprintf(session->settings, "Can't parse '%s' from distributor\n", line);
-          return NULL;
+          break;
         }
         if ( index < in || index >= last ) {
           qprintf(session->settings, "Invalid index %u from distributor\n", index);
-          return NULL;
+          break;
         }
         session->population[index].fitness = fitness;
         GA_cache_fitness(session, index, GA_hash_individual(session, in));
         thread_send_result(session, index, found);
         i++;
       }
+      if ( failed ) {
+        thread_send_result(session, in, GA_DIST_FAILED);
+        return NULL;
+      }
     }
     else {
       found = GA_do_checkfitness(thread, in);
@@ -667,18 +1314,20 @@ static void display_individual(GA_session *session, unsigned int i,
                                int always, char *type) {
   unsigned int j;
   char *str = NULL;
+  size_t len;
   int rc = asprintf(&str,
-     "%-4s %04u %04u   GD 000 %10u score %9.7f orig %15.3f",
+     "%-4s %04u %04u   GD 000 %10" GA_PRIu " score %9.7f orig %15.3f",
      type, session->generation, i, session->population[i].gdsegments[0],
      session->population[i].fitness, session->population[i].unscaledfitness);
   if ( rc < 0 ) return;
+  len = rc;
   /* Use more lines for additional segments */
   for ( j = 1; j < session->population[i].segmentcount; j++ ) {
     char *substr = NULL;
-    rc = asprintf(&substr, "                 GD %03d %10u", j,
+    rc = asprintf(&substr, "                 GD %03d %10" GA_PRIu, j,
                   session->population[i].gdsegments[j]);
     if ( rc < 0 ) return;
-    if ( astrcat(&str, substr) ) return; /* failed */
+    if ( astrcat(&str, &len, substr) ) return; /* failed */
     free(substr);
   }
 
@@ -732,11 +1381,15 @@ int GA_checkfitness(GA_session *session) {
                         "GA_checkfitness: mutex_lock(in): %d\n", rc); exit(1); }
     session->inindex = cfinite;
     session->inflag = 1;
+    if ( session->settings->disthybrid ) GA_hybrid_dispatch(session, cfinite);
     rc = pthread_mutex_unlock(&(session->inmutex));
     if ( rc )
       { qprintf(session->settings,
                 "GA_checkfitness: mutex_unlock(in): %d\n", rc); exit(1); }
-    rc = pthread_cond_signal(&(session->incond));
+    /* In hybrid mode, the threads do not pass the signal on */
+    if ( session->settings->disthybrid )
+      rc = pthread_cond_broadcast(&(session->incond));
+    else rc = pthread_cond_signal(&(session->incond));
     if ( rc ) { qprintf(session->settings,
                         "GA_checkfitness: cond_signal(in): %d\n", rc); exit(1); }
 #endif
@@ -777,7 +1430,7 @@ int GA_checkfitness(GA_session *session) {
       found = GA_do_checkfitness(&(session->threads[0]), i);
 #endif
 
-      if ( found > 50 ) return found; /* Error */
+      if ( found > 50 ) return found; /* Error, e.g. GA_DIST_FAILED */
       if ( !found ) fevs++;         /* Had to do a real fitness evaluation */
 
       lprintf(session->settings, "Got %d %d.\n", j, i);
@@ -794,6 +1447,9 @@ int GA_checkfitness(GA_session *session) {
       mean += session->population[i].fitness;
       cfinite++;
     }
+#if THREADS
+    if ( session->settings->disthybrid ) GA_hybrid_wait_steals(session);
+#endif
   }
   mean = mean/(cfinite ? cfinite : 1);/* session->settings->popsize; */
 
@@ -848,26 +1504,29 @@ int GA_checkfitness(GA_session *session) {
   }
 
   /* Sort the sorted list. */
-  GA_comparator(session, NULL); /* Initialize comparator */
   /* printf("%u\n", session->sorted[0]); */
-  qsort(&(session->sorted[0]), session->settings->popsize,
-        sizeof(unsigned int), GA_comparator);
+  GA_sort_indices(session->sorted, session->settings->popsize, session);
   /* printf("%u\n", session->sorted[0]); */
   session->fittest = session->sorted[0]; /* Since sorting seems to work */
   if ( session->sorted[0] != session->fittest ) {
     /* Did not choose same item. Do full comparison, return error if fails */
     /* FIXME - Completely broken!!! (Fails for ga-numbers) */
     /* Does this work now? */
-    int mc = memcmp(&(session->population[session->sorted[0]].segments[0]),
-                    &(session->population[session->fittest  ].segments[0]),
-                    sizeof(GA_segment)*session->population[session->fittest].
-                                          segmentcount);
-    if ( mc ) {
+    int mc = GA_segments_equal(session->population[session->sorted[0]].segments,
+                               session->population[session->fittest].segments,
+                               session->population[session->fittest].
+                                 segmentcount);
+    if ( !mc ) {
       qprintf(session->settings, "Sort failed: S=%u vs F=%u\n",
               session->sorted[0], session->fittest);
       return 2;
     }
   }
+  /* The fitness the elites of the next generation start from */
+  if ( session->settings->elitism > 0 &&
+       session->settings->elitism <= session->settings->popsize )
+    session->threshold = session->population[
+      session->sorted[session->settings->elitism-1]].unscaledfitness;
   /* Display the best individual */
   display_individual(session, session->fittest, 1, "BEST");
   lprintf(session->settings, "\n");
@@ -876,7 +1535,7 @@ int GA_checkfitness(GA_session *session) {
 
 GA_segment graydecode(GA_segment gray) {
   GA_segment bin;
-#if GA_segment_size == 32
+#if GA_segment_size == 32 || GA_segment_size == 64
   /* Optimization: b = b^(g>>1);b = b^(b>>2); ...4; ... 8; ... 16;
      IF(64BIT,...32) -- can be much faster. */
   bin = gray;
@@ -885,8 +1544,14 @@ GA_segment graydecode(GA_segment gray) {
   bin ^= bin>>4;
   bin ^= bin>>8;
   bin ^= bin>>16;
+#if GA_segment_size == 64
+  bin ^= bin>>32;
+#endif
 #else
-  for ( bin = 0; gray; gray >>= 1 ) bin ^= gray;
+  /* Any other width: same prefix-XOR, one doubling shift per step */
+  unsigned int shift;
+  bin = gray;
+  for ( shift = 1; shift < GA_segment_size; shift <<= 1 ) bin ^= bin>>shift;
 #endif
   return bin;
 }
@@ -895,6 +1560,233 @@ GA_segment grayencode(GA_segment bin) {
   return bin ^ (bin >> 1);
 }
 
+/* Segment array kernels. Each has a scalar version; GA_simd_init selects
+ * the widest version the CPU supports. The results do not depend on
+ * which version is used. */
+static void GA_graydecode_array_scalar(GA_segment *dst, const GA_segment *src,
+                                       unsigned int n) {
+  unsigned int i;
+  for ( i = 0; i < n; i++ ) dst[i] = graydecode(src[i]);
+}
+
+static int GA_segments_equal_scalar(const GA_segment *a, const GA_segment *b,
+                                    unsigned int n) {
+  return !memcmp(a, b, sizeof(GA_segment)*n);
+}
+
+static GA_segment GA_segments_xor_scalar(const GA_segment *a, unsigned int n) {
+  GA_segment x = 0;
+  unsigned int i;
+  for ( i = 0; i < n; i++ ) x ^= a[i];
+  return x;
+}
+
+#if GA_SIMD
+#if GA_segment_size == 32
+#define GA_SRLI256 _mm256_srli_epi32
+#define GA_SRLI512 _mm512_srli_epi32
+#else
+#define GA_SRLI256 _mm256_srli_epi64
+#define GA_SRLI512 _mm512_srli_epi64
+#endif
+/* Segments per vector */
+#define GA_LANES256 (256/GA_segment_size)
+#define GA_LANES512 (512/GA_segment_size)
+
+__attribute__((target("avx2")))
+static void GA_graydecode_array_avx2(GA_segment *dst, const GA_segment *src,
+                                     unsigned int n) {
+  unsigned int i;
+  for ( i = 0; i+GA_LANES256 <= n; i += GA_LANES256 ) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src+i));
+    v = _mm256_xor_si256(v, GA_SRLI256(v, 1));
+    v = _mm256_xor_si256(v, GA_SRLI256(v, 2));
+    v = _mm256_xor_si256(v, GA_SRLI256(v, 4));
+    v = _mm256_xor_si256(v, GA_SRLI256(v, 8));
+    v = _mm256_xor_si256(v, GA_SRLI256(v, 16));
+#if GA_segment_size == 64
+    v = _mm256_xor_si256(v, GA_SRLI256(v, 32));
+#endif
+    _mm256_storeu_si256((__m256i *)(dst+i), v);
+  }
+  GA_graydecode_array_scalar(dst+i, src+i, n-i);
+}
+
+__attribute__((target("avx2")))
+static int GA_segments_equal_avx2(const GA_segment *a, const GA_segment *b,
+                                  unsigned int n) {
+  unsigned int i;
+  for ( i = 0; i+GA_LANES256 <= n; i += GA_LANES256 ) {
+    __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a+i)),
+                                 _mm256_loadu_si256((const __m256i *)(b+i)));
+    if ( !_mm256_testz_si256(x, x) ) return 0;
+  }
+  return GA_segments_equal_scalar(a+i, b+i, n-i);
+}
+
+__attribute__((target("avx2")))
+static GA_segment GA_segments_xor_avx2(const GA_segment *a, unsigned int n) {
+  GA_segment lanes[GA_LANES256];
+  __m256i x = _mm256_setzero_si256();
+  unsigned int i;
+  for ( i = 0; i+GA_LANES256 <= n; i += GA_LANES256 )
+    x = _mm256_xor_si256(x, _mm256_loadu_si256((const __m256i *)(a+i)));
+  _mm256_storeu_si256((__m256i *)lanes, x);
+  return GA_segments_xor_scalar(lanes, GA_LANES256) ^
+    GA_segments_xor_scalar(a+i, n-i);
+}
+
+__attribute__((target("avx512f")))
+static void GA_graydecode_array_avx512(GA_segment *dst, const GA_segment *src,
+                                       unsigned int n) {
+  unsigned int i;
+  for ( i = 0; i+GA_LANES512 <= n; i += GA_LANES512 ) {
+    __m512i v = _mm512_loadu_si512((const void *)(src+i));
+    v = _mm512_xor_si512(v, GA_SRLI512(v, 1));
+    v = _mm512_xor_si512(v, GA_SRLI512(v, 2));
+    v = _mm512_xor_si512(v, GA_SRLI512(v, 4));
+    v = _mm512_xor_si512(v, GA_SRLI512(v, 8));
+    v = _mm512_xor_si512(v, GA_SRLI512(v, 16));
+#if GA_segment_size == 64
+    v = _mm512_xor_si512(v, GA_SRLI512(v, 32));
+#endif
+    _mm512_storeu_si512((void *)(dst+i), v);
+  }
+  GA_graydecode_array_avx2(dst+i, src+i, n-i);
+}
+
+__attribute__((target("avx512f")))
+static int GA_segments_equal_avx512(const GA_segment *a, const GA_segment *b,
+                                    unsigned int n) {
+  unsigned int i;
+  for ( i = 0; i+GA_LANES512 <= n; i += GA_LANES512 ) {
+    __m512i x = _mm512_xor_si512(_mm512_loadu_si512((const void *)(a+i)),
+                                 _mm512_loadu_si512((const void *)(b+i)));
+    if ( _mm512_test_epi64_mask(x, x) ) return 0;
+  }
+  return GA_segments_equal_avx2(a+i, b+i, n-i);
+}
+
+__attribute__((target("avx512f")))
+static GA_segment GA_segments_xor_avx512(const GA_segment *a, unsigned int n) {
+  GA_segment lanes[GA_LANES512];
+  __m512i x = _mm512_setzero_si512();
+  unsigned int i;
+  for ( i = 0; i+GA_LANES512 <= n; i += GA_LANES512 )
+    x = _mm512_xor_si512(x, _mm512_loadu_si512((const void *)(a+i)));
+  _mm512_storeu_si512((void *)lanes, x);
+  return GA_segments_xor_scalar(lanes, GA_LANES512) ^
+    GA_segments_xor_avx2(a+i, n-i);
+}
+#endif /* GA_SIMD */
+
+static void (*GA_graydecode_array_impl)(GA_segment *, const GA_segment *,
+                                        unsigned int) =
+  GA_graydecode_array_scalar;
+static int (*GA_segments_equal_impl)(const GA_segment *, const GA_segment *,
+                                     unsigned int) = GA_segments_equal_scalar;
+static GA_segment (*GA_segments_xor_impl)(const GA_segment *, unsigned int) =
+  GA_segments_xor_scalar;
+
+static void GA_simd_select(void) {
+#if GA_SIMD
+  __builtin_cpu_init();
+  if ( __builtin_cpu_supports("avx512f") ) {
+    GA_graydecode_array_impl = GA_graydecode_array_avx512;
+    GA_segments_equal_impl = GA_segments_equal_avx512;
+    GA_segments_xor_impl = GA_segments_xor_avx512;
+  }
+  else if ( __builtin_cpu_supports("avx2") ) {
+    GA_graydecode_array_impl = GA_graydecode_array_avx2;
+    GA_segments_equal_impl = GA_segments_equal_avx2;
+    GA_segments_xor_impl = GA_segments_xor_avx2;
+  }
+#endif
+}
+
+static void GA_simd_init(void) {
+#if THREADS
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, GA_simd_select);
+#else
+  static int done = 0;
+  if ( !done ) GA_simd_select();
+  done = 1;
+#endif
+}
+
+void GA_graydecode_array(GA_segment *dst, const GA_segment *src,
+                         unsigned int n) {
+  GA_graydecode_array_impl(dst, src, n);
+}
+
+int GA_segments_equal(const GA_segment *a, const GA_segment *b,
+                      unsigned int n) {
+  return GA_segments_equal_impl(a, b, n);
+}
+
+GA_segment GA_segments_xor(const GA_segment *a, unsigned int n) {
+  return GA_segments_xor_impl(a, n);
+}
+
+#if GA_SIMD
+/* Compare one set of vector kernels with the scalar versions, for
+ * GA_check_kernels. Lengths up to three 512-bit vectors plus a tail are
+ * tried, at every alignment within a vector. */
+static int GA_check_kernel_set(const char *name,
+    void (*decode)(GA_segment *, const GA_segment *, unsigned int),
+    int (*equal)(const GA_segment *, const GA_segment *, unsigned int),
+    GA_segment (*fold)(const GA_segment *, unsigned int)) {
+  GA_segment src[4*GA_LANES512], other[4*GA_LANES512];
+  GA_segment want[4*GA_LANES512], got[4*GA_LANES512];
+  unsigned int seed = 12345, i, n, off, bad = 0;
+  for ( i = 0; i < 4*GA_LANES512; i++ ) {
+    unsigned int j;
+    src[i] = 0;
+    for ( j = 0; j < GA_segment_size; j += 16 ) {
+      seed = seed*1103515245+12345;
+      src[i] = (src[i]<<16) ^ (seed>>16);
+    }
+  }
+  for ( off = 0; off < GA_LANES512; off++ ) {
+    for ( n = 0; off+n <= 4*GA_LANES512; n++ ) {
+      GA_graydecode_array_scalar(want, src+off, n);
+      decode(got, src+off, n);
+      if ( memcmp(want, got, sizeof(GA_segment)*n) ) bad++;
+      if ( fold(src+off, n) != GA_segments_xor_scalar(src+off, n) ) bad++;
+      memcpy(other, src, sizeof(other));
+      if ( !equal(src+off, other+off, n) ) bad++;
+      for ( i = 0; i < n; i++ ) {
+        other[off+i] ^= (GA_segment)1 << (i%GA_segment_size);
+        if ( equal(src+off, other+off, n) ) bad++;
+        other[off+i] = src[off+i];
+      }
+    }
+  }
+  printf("KERN %-7s %s\n", name, bad ? "MISMATCH" : "ok");
+  return bad ? 1 : 0;
+}
+#endif
+
+int GA_check_kernels(void) {
+  int bad = 0;
+#if GA_SIMD
+  __builtin_cpu_init();
+  if ( __builtin_cpu_supports("avx2") )
+    bad += GA_check_kernel_set("avx2", GA_graydecode_array_avx2,
+                               GA_segments_equal_avx2, GA_segments_xor_avx2);
+  else printf("KERN %-7s not supported by this CPU\n", "avx2");
+  if ( __builtin_cpu_supports("avx512f") )
+    bad += GA_check_kernel_set("avx512", GA_graydecode_array_avx512,
+                               GA_segments_equal_avx512,
+                               GA_segments_xor_avx512);
+  else printf("KERN %-7s not supported by this CPU\n", "avx512");
+#else
+  printf("KERN vector kernels not built\n");
+#endif
+  return bad;
+}
+
 unsigned int urandom() {
   unsigned int out;
   FILE *fh;
@@ -904,23 +1796,15 @@ unsigned int urandom() {
   return out;
 }
 
-/** Append second string into first. Repeated appends to the same
- * string are cached, making this an O(n) function, where n =
- * strlen(append).
+/** Append second string into first, separated by a newline. The caller
+ * keeps the length of *s in *len (updated here), making this an O(n)
+ * function, where n = strlen(append).
  *
  * From public domain file src/usr.bin/sdiff/sdiff.c in
  * ftp://ftp.netbsd.org/pub/NetBSD/NetBSD-current/tar_files/src/usr.bin.tar.gz
  */
-static int astrcat(char **s, const char *append) {
-  /* Length of string in previous run. */
-  static size_t offset = 0;
-  size_t newsiz;
-  /* String from previous run.  Compared to *s to see if we are
-   * dealing with the same string.  If so, we can use offset. */
-
-  /* nandhp: This doesn't work if a new string is allocated at the same
-   * address as the previous one. This causes display problems. FIXME */
-  /*static*/ const char *oldstr = NULL;
+static int astrcat(char **s, size_t *len, const char *append) {
+  size_t offset = *len, newsiz;
   char *newstr;
 
   /* First string is NULL, so just copy append. */
@@ -928,22 +1812,13 @@ static int astrcat(char **s, const char *append) {
     if (!(*s = strdup(append))) return 1;
 
     /* Keep track of string. */
-    offset = strlen(*s);
-    oldstr = *s;
+    *len = strlen(*s);
 
     return 0;
   }
 
   /* *s is a string so concatenate. */
 
-  /* Did we process the same string in the last run? If this is a
-   * different string from the one we just processed cache new
-   * string. */
-  if (oldstr != *s) {
-    offset = strlen(*s);
-    oldstr = *s;
-  }
-
   /* Size = strlen(*s) + \n + strlen(append) + '\0'. */
   newsiz = offset + 1 + strlen(append) + 1;
 
@@ -958,12 +1833,108 @@ static int astrcat(char **s, const char *append) {
   strncat(*s + offset, append, newsiz - offset);
 
   /* New string length should be exactly newsiz - 1 characters. */
-  /* Store generated string's values. */
-  offset = newsiz - 1;
-  oldstr = *s;
+  *len = newsiz - 1;
   return 0;
 }
 
+/* Sort population indices by fitness, best first. */
+static void GA_sort_indices(unsigned int *base, size_t n, GA_session *session) {
+#ifdef __GLIBC__
+  qsort_r(base, n, sizeof(unsigned int), GA_comparator, session);
+#else
+  /* qsort_r's argument order is not portable; use a stable insertion
+   * sort (populations are small). */
+  size_t i, j;
+  for ( i = 1; i < n; i++ ) {
+    unsigned int v = base[i];
+    for ( j = i; j > 0 && GA_comparator(&base[j-1], &v, session) > 0; j-- )
+      base[j] = base[j-1];
+    base[j] = v;
+  }
+#endif
+}
+
+/** Count the CPUs available to this process, for --threads auto. */
+static int GA_cpu_count(void) {
+#if THREADS
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  /* Respect taskset/cgroup restrictions */
+  if ( sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0 )
+    return CPU_COUNT(&set);
+#endif
+#ifdef _SC_NPROCESSORS_ONLN
+  {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if ( n > 0 ) return (int)n;
+  }
+#endif
+#endif
+  return 1;
+}
+
+#if THREADS && defined(__linux__)
+/* Physical package (socket) of a CPU, or 0 if unknown. */
+static int GA_cpu_package(int cpu) {
+  char fn[128];
+  int pkg = 0;
+  FILE *fh;
+  snprintf(fn, sizeof(fn),
+           "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+  if ( (fh = fopen(fn, "r")) == NULL ) return 0;
+  if ( fscanf(fh, "%d", &pkg) != 1 || pkg < 0 ) pkg = 0;
+  fclose(fh);
+  return pkg;
+}
+
+/** Build the list of CPUs to pin worker threads to, in the order they
+ * are to be assigned. The list (freed by the caller) is stored in cpus.
+ *
+ * \returns The number of CPUs in the list, or 0 on failure.
+ */
+static int GA_cpu_order(int pinmode, int **cpus) {
+  cpu_set_t set;
+  int i, j, n = 0;
+  int *pkg, *key;
+  *cpus = NULL;
+  if ( sched_getaffinity(0, sizeof(set), &set) != 0 ) return 0;
+  if ( (*cpus = malloc(sizeof(int)*CPU_COUNT(&set))) == NULL ) return 0;
+  pkg = malloc(sizeof(int)*CPU_COUNT(&set));
+  key = malloc(sizeof(int)*CPU_COUNT(&set));
+  if ( !pkg || !key ) {
+    free(pkg); free(key); free(*cpus); *cpus = NULL;
+    return 0;
+  }
+  for ( i = 0; i < CPU_SETSIZE && n < CPU_COUNT(&set); i++ ) {
+    if ( !CPU_ISSET(i, &set) ) continue;
+    (*cpus)[n] = i;
+    pkg[n] = GA_cpu_package(i);
+    n++;
+  }
+  /* Compact: order by package. Scatter: order by position within the
+   * package, so consecutive threads land on different packages. */
+  for ( i = 0; i < n; i++ ) {
+    int rank = 0;
+    for ( j = 0; j < i; j++ ) if ( pkg[j] == pkg[i] ) rank++;
+    key[i] = ( pinmode == GA_PIN_SCATTER ) ? rank : pkg[i];
+  }
+  /* Stable insertion sort (CPU numbers stay ascending within a key) */
+  for ( i = 1; i < n; i++ ) {
+    int c = (*cpus)[i], k = key[i];
+    for ( j = i; j > 0 && key[j-1] > k; j-- ) {
+      (*cpus)[j] = (*cpus)[j-1];
+      key[j] = key[j-1];
+    }
+    (*cpus)[j] = c;
+    key[j] = k;
+  }
+  free(pkg);
+  free(key);
+  return n;
+}
+#endif
+
 /** Helper function for GA_getopt.
  *
  * \param argc,argv       Command-line arguments, from main.
@@ -985,6 +1956,7 @@ int GA_run_getopt(int argc, char * const argv[], GA_settings *settings,
                   int global_count, GA_my_parseopt_t my_parse_option,
                   const char *my_usage, char **optlog, char optlogtype) {
   int c;
+  settings->optsource = optlogtype;
   while (1) {
    /* getopt_long stores the option index here. */
    int option_index = 0;
@@ -1009,7 +1981,11 @@ int GA_run_getopt(int argc, char * const argv[], GA_settings *settings,
          }
        }
      }
-     if ( msg && rc > 0 ) { astrcat(optlog, msg); free(msg); }
+     if ( msg && rc > 0 ) {
+       size_t len = strlen(*optlog);
+       astrcat(optlog, &len, msg);
+       free(msg);
+     }
    }
 
    /* Detect the end of the options. */
@@ -1045,7 +2021,9 @@ int GA_run_getopt(int argc, char * const argv[], GA_settings *settings,
      settings->debugmode = 1;
      break;
    case 'T':
-     settings->threadcount = atoi(optarg);
+     if ( strcmp(optarg, "auto") == 0 )
+       settings->threadcount = GA_cpu_count();
+     else settings->threadcount = atoi(optarg);
      break;
    case 'E':
      settings->elitism = atoi(optarg);
@@ -1072,6 +2050,21 @@ int GA_run_getopt(int argc, char * const argv[], GA_settings *settings,
    case 14: /* --dynamic-mutation-range */
      settings->dynmut_range = atof(optarg);
      break;
+   case 16: /* --repair */
+     settings->repair = 1;
+     break;
+   case 15: /* --pin */
+     if ( strcmp(optarg, "compact") == 0 )
+       settings->pinmode = GA_PIN_COMPACT;
+     else if ( strcmp(optarg, "scatter") == 0 )
+       settings->pinmode = GA_PIN_SCATTER;
+     else if ( strcmp(optarg, "none") == 0 )
+       settings->pinmode = GA_PIN_NONE;
+     else {
+       printf("Unknown thread placement '%s'\n", optarg);
+       exit(1);
+     }
+     break;
    case 'h':
    case '?':
      /* getopt_long already printed an error message. */
@@ -1140,7 +2133,8 @@ int GA_getopt(int argc, char * const argv[], GA_settings *settings,
     /** -T, --threads NUMBER
      *
      * Specify the number of fitness evalutions to perform at once. If
-     * threading is not available, must specify 1.
+     * threading is not available, must specify 1. Specify "auto" to use
+     * one thread per CPU this process is allowed to run on.
      */
     {"threads",   required_argument, 0, 'T'},
     /** -E, --elitism NUMBER
@@ -1200,6 +2194,21 @@ int GA_getopt(int argc, char * const argv[], GA_settings *settings,
      * minimum+range, which must be less than or equal to 1).
      */
     {"dynamic-mutation-range", required_argument, 0, 14},
+    /** --pin MODE
+     *
+     * Pin each worker thread (and any processes it starts) to a single
+     * CPU. MODE is "compact" to fill one CPU package before using the
+     * next, "scatter" to alternate between packages, or "none" (the
+     * default). Only supported on Linux.
+     */
+    {"pin", required_argument, 0, 15},
+    /** --repair
+     *
+     * Repair new individuals that violate the problem's constraints
+     * (for example, segment ranges) instead of discarding them and
+     * breeding replacements. Useful when the valid region is small.
+     */
+    {"repair", no_argument, 0, 16},
     /*
       {"verbose", no_argument,       &verbose_flag, 1},
       {"brief",   no_argument,       &verbose_flag, 0},
@@ -1353,6 +2362,11 @@ int qprintf(const GA_settings *settings, const char *format, ...) {
   return rc;
 }
 
+#if THREADS
+/** Serializes output from qprintf, lprintf, tprintf and invisible_system. */
+pthread_mutex_t GA_iomutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 int tprintf(const char *format, ...) {
   va_list ap;
   int rc = 0;
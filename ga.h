@@ -4,6 +4,7 @@
  */
 #ifndef _HAVE_GA_H
 #include <stdint.h>
+#include <inttypes.h>
 #include <getopt.h>
 #if THREADS
 #include <pthread.h>
@@ -14,16 +15,18 @@
 
 /* Library typedefs */
 
-#if !defined(GA_segment) || !defined(GA_segment_size)
-/** The type of a segment. This is expected to be some kind of
- * integer-type. The bit-width of the type must be specified in
- * GA_segment_size.
- */
-#define GA_segment uint32_t
-/** The size, in bits, of a segment. */
-#define GA_segment_size 32
-#warning Using default GA_segment definition
-#endif
+#include "ga-segment.h"
+
+/** \name Thread placement modes
+ * Values for GA_settings.pinmode.
+ * \{ */
+/** Do not pin worker threads; let the scheduler place them. */
+#define GA_PIN_NONE     0
+/** Pin worker threads to CPUs, filling one package before the next. */
+#define GA_PIN_COMPACT  1
+/** Pin worker threads to CPUs, alternating between packages. */
+#define GA_PIN_SCATTER  2
+/* \} */
 
 /** A single individual of the population.
  */
@@ -89,11 +92,32 @@ typedef struct GA_settings_struct {
   FILE *logfh;
   /** Number of threads to use. */
   int threadcount;
+  /** Placement of worker threads on CPUs (GA_PIN_NONE, GA_PIN_COMPACT or
+   * GA_PIN_SCATTER). */
+  int pinmode;
   /** Allow caching. Set to false if fitness metric varies over time. */
   int usecaching;
+  /** Repair new individuals with GA_repair before checking them with
+   * GA_fitness_quick. */
+  int repair;
   /** Distributor for distributed algorithm. If NULL, evaluate fitness
    * locally. */
   FILE *distributor;
+  /** Exchange binary frames with the distributor instead of text lines.
+   * \see GA_DIST_VERSION */
+  int distbinary;
+  /** Hybrid mode: evaluate part of each generation with local threads
+   * while the first thread sends the rest to the distributor. Requires
+   * distbinary. \see GA_session.remoteflag */
+  int disthybrid;
+  /** Hybrid mode: seconds after which individuals still pending at the
+   * distributor are also evaluated locally, or 0 for twice the time the
+   * distributor is expected to take. */
+  double distdeadline;
+  /** Origin of the option being parsed: 'F' for the configuration file,
+   * 'A' for command-line arguments. Set for my_parse_option by
+   * GA_getopt. */
+  char optsource;
   /** Pointer to problem-specific options structure (for use in
    * options parsing and fitness evaluation). */
   void *ref;
@@ -139,6 +163,13 @@ typedef struct GA_session_struct {
   /** The sum of the fitness over all individuals. Used by the
    * roulette algorithm. */
   double fitnesssum;
+  /** The unscaled fitness of the least fit individual that was kept by
+   * elitism from the previous generation, or -HUGE_VAL before the first
+   * generation has been evaluated. Individuals of the generation being
+   * evaluated that are less fit than this can only be chosen by roulette,
+   * so GA_fitness may return an upper bound for them instead of their
+   * exact fitness. Not changed while a generation is evaluated. */
+  double threshold;
   /** The size of the fitnesscache. */
   unsigned int cachesize;
   /** Dynamic mutation leading fitness. */
@@ -152,6 +183,9 @@ typedef struct GA_session_struct {
   GA_settings *settings;
   /** Array of GA_thread structures, representing each thread. */
   GA_thread *threads;
+  /** Contiguous storage for the segments and gdsegments of both
+   * population and oldpop. */
+  GA_segment *arena;
 #if THREADS
   /** Mutex to control access to worker thread from main thread. */
   pthread_mutex_t inmutex;
@@ -161,6 +195,8 @@ typedef struct GA_session_struct {
   int inindex;
   /** Flag to indicate availability of new input data. */
   int inflag;
+  /** Flag telling worker threads to exit (set by GA_cleanup). */
+  int shutdown;
 
   /** Mutex to control access to main thread from worker thread. */
   pthread_mutex_t outmutex;
@@ -175,6 +211,52 @@ typedef struct GA_session_struct {
 
   /** Mutex to control access to fitness cache. */
   pthread_mutex_t cachemutex;
+
+  /** Distributor round each individual is pending in, or 0 (binary
+   * protocol). Only the first result for an individual is used. Protected
+   * by outmutex. */
+  unsigned int *pending;
+  /** Number of the last distributor round. Protected by inmutex. */
+  unsigned int remoteround;
+  /** Hybrid mode: stream for reading results from the distributor,
+   * separate from GA_settings.distributor so that the main thread can
+   * write to the distributor while the results of a round are still
+   * coming in. */
+  FILE *distin;
+  /* The remaining fields are protected by inmutex. */
+  /** Hybrid mode: end of the range of individuals for local threads. */
+  int inend;
+  /** Hybrid mode: individuals remotein..popsize-1 wait to be sent to
+   * the distributor. */
+  int remoteflag;
+  /** Hybrid mode: first individual sent to the distributor. */
+  int remotein;
+  /** Hybrid mode: the distributor thread has a round out. */
+  int remotebusy;
+  /** Hybrid mode: the distributor failed, so everything is evaluated
+   * locally. */
+  int remotefailed;
+  /** Hybrid mode: number of individuals sent in the current round, and
+   * when. */
+  int remotecount;
+  double remotestart;
+  /** Hybrid mode: time (as from gettimeofday) after which idle local
+   * threads also evaluate individuals still pending at the distributor,
+   * from stealindex on, or 0. */
+  double remotedeadline;
+  /** Hybrid mode: next individual to check for being overdue. */
+  int stealindex;
+  /** Hybrid mode: overdue individuals being evaluated locally. A round
+   * is only over once they are done, as GA_fitness still reads the
+   * session. */
+  int stealing;
+  /** Hybrid mode: individuals evaluated per second by the distributor
+   * and by the local threads, or 0 until measured. */
+  double remoterate, localrate;
+  /** Hybrid mode: individuals of the local range that are done, time of
+   * the last one, and time of the dispatch. */
+  int localdone;
+  double localtime, dispatchtime;
 #endif
 #if HAVE_GSL
   /* Random number generator. */
@@ -210,13 +292,14 @@ int GA_defaultsettings(GA_settings *settings);
  *
  * \returns 0 to indicate success, 1 through 7 if a memory allocation
  * failed, 50 if an invalid thread count is specified, 51 if an error
- * occurs starting a thread, 55 if the thread_init function fails, 90
- * if any fitness function failed.
+ * occurs starting a thread, 55 if the thread_init function fails, 56 if
+ * the distributor cannot be opened for reading, 90 if any fitness
+ * function or the distributor failed.
  */
 int GA_init(GA_session *session, GA_settings *settings,
             unsigned int segmentcount);
 
-/** Free all allocated structures.
+/** Stop the worker threads and free all allocated structures.
  *
  * \param session     A previously intialized GA_session object.
  *
@@ -231,7 +314,8 @@ int GA_cleanup(GA_session *session);
  * \param generations
  *   The number of generations to run, 0 to use GA_settings.generations.
  *
- * \returns 0 to indicate success, 1 if any fitness function failed.
+ * \returns 0 to indicate success, 1 if any fitness function or the
+ *     distributor failed.
  */
 int GA_evolve(GA_session *session, unsigned int generations);
 
@@ -253,11 +337,15 @@ void GA_generate(GA_session *session, unsigned int i);
  */
 unsigned int GA_roulette(GA_session *session);
 
-/** Comparison function for sorting individuals by fitness.
+/** Comparison function for sorting population indexes by fitness,
+ * most fit first.
  *
- * \see qsort(3)
+ * \param a,b  Pointers to the unsigned int indexes to compare.
+ * \param arg  The GA_session the indexes refer to.
+ *
+ * \see qsort_r(3)
  */
-int GA_comparator(const void *a, const void *b);
+int GA_comparator(const void *a, const void *b, void *arg);
 
 /** Check the fitness of all individuals. Updates
  * GA_individual.fitness, GA_session.fittest GA_session.fitnesssum.
@@ -293,7 +381,10 @@ extern int GA_fitness(const GA_session *ga, void *thbuf, GA_individual *elem);
  */
 extern int GA_termination(const GA_session *ga);
 
-/** Initialize problem-specific thread state.
+/** Initialize problem-specific thread state. Not called for threads that
+ * only send individuals to the distributor (all threads with
+ * GA_settings.distributor, or only the first with disthybrid), which
+ * never call GA_fitness and keep a NULL GA_thread.ref.
  *
  * \param thread The GA_thread object for the thread.
  *
@@ -301,7 +392,8 @@ extern int GA_termination(const GA_session *ga);
  */
 extern int GA_thread_init(GA_thread *thread);
 
-/** Free problem-specific thread state.
+/** Free problem-specific thread state. Only called for threads that
+ * GA_thread_init was called for.
  *
  * \param thread The GA_thread object for the thread.
  *
@@ -317,6 +409,16 @@ extern int GA_thread_free(GA_thread *thread);
  */
 extern int GA_fitness_quick(const GA_session *ga, GA_individual *elem);
 
+/** Move the given individual onto (or towards) the region accepted by
+ * GA_fitness_quick, for example by clamping segments to their ranges.
+ * Only called if GA_settings.repair is set. The implementation must keep
+ * GA_individual.segments and GA_individual.gdsegments consistent, and
+ * should not use the random number generator.
+ *
+ * \returns Nonzero if the individual was modified, otherwise 0.
+ */
+extern int GA_repair(const GA_session *ga, GA_individual *elem);
+
 /** Generate a random number.
  *
  * \returns 0 for success, nonzero for error.
@@ -349,6 +451,32 @@ extern int GA_starting_generation(GA_session *ga);
  */
 GA_segment graydecode(GA_segment gray);
 
+/** Graydecode an array of n segments from src into dst. Uses AVX2 or
+ * AVX-512 if the CPU supports it. dst and src may be the same array.
+ *
+ * \see graydecode
+ */
+void GA_graydecode_array(GA_segment *dst, const GA_segment *src,
+                         unsigned int n);
+
+/** Compare two arrays of n segments.
+ *
+ * \returns Nonzero if the arrays are equal, otherwise 0.
+ */
+int GA_segments_equal(const GA_segment *a, const GA_segment *b,
+                      unsigned int n);
+
+/** XOR together an array of n segments (used for hashing genomes). */
+GA_segment GA_segments_xor(const GA_segment *a, unsigned int n);
+
+/** Check that the AVX2 and AVX-512 versions of the segment array kernels
+ * give the same results as the scalar versions, for each version the CPU
+ * supports. Prints one line per version.
+ *
+ * \returns The number of versions that gave different results.
+ */
+int GA_check_kernels(void);
+
 /** Helper function to convert from binary to Gray code.
  *
  * \see http://en.wikipedia.org/wiki/Gray_code
@@ -431,6 +559,43 @@ int lprintf(const GA_settings *settings, const char *format, ...);
  */
 int tprintf(const char *format, ...);
 
+/** \name Distributor Protocol
+ *
+ * With GA_settings.distbinary, everything sent to and received from the
+ * distributor after the configuration (and a line "BINARY
+ * GA_DIST_VERSION") is a frame: a 4-byte length of the rest of the frame,
+ * a type byte, and the payload. Integers are unsigned and big-endian,
+ * segments take GA_segment_size/8 bytes, and fitness values are IEEE
+ * doubles sent as 64-bit integers. Items and results are tagged with
+ * their generation and index, so results may come back in any order and
+ * in batches of any size.
+ *
+ * \{ */
+#define GA_DIST_VERSION 1
+/** Text, as in the text protocol (CFG and V lines) */
+#define GA_DIST_TEXT 'T'
+/** Individuals: 32-bit generation, segment count and bytes per segment,
+ * then for each individual its 32-bit index and its graydecoded segments */
+#define GA_DIST_ITEMS 'I'
+/** All individuals of a generation have been sent: 32-bit generation and
+ * number of individuals */
+#define GA_DIST_DISPATCH 'G'
+/** Fitness values: 32-bit generation, then for each individual its
+ * 32-bit index and its fitness */
+#define GA_DIST_RESULTS 'R'
+/** All results of a generation have been sent: 32-bit generation */
+#define GA_DIST_DONE 'D'
+/** Largest frame that is accepted */
+#define GA_DIST_MAXFRAME (64*1024*1024)
+
+/** Send text to the distributor, in a GA_DIST_TEXT frame if
+ * GA_settings.distbinary is set, and flush it.
+ *
+ * \returns The number of characters sent, or a negative value on error.
+ */
+int GA_distributor_printf(GA_settings *settings, const char *format, ...);
+/* \} */
+
 /** Generate a random number using the session's random number generator.
  * Arbitrary range. Not thread-safe.
  */
@@ -443,7 +608,7 @@ double GA_rand_double(GA_session *session);
 
 #if THREADS
 /* Consider abandoning this mutex in favor of flockfile on */
-extern pthread_mutex_t GA_iomutex;/* = PTHREAD_MUTEX_INITIALIZER; */
+extern pthread_mutex_t GA_iomutex; /* Defined in ga.c */
 #endif
 
 #define _HAVE_GA_H
@@ -27,18 +27,18 @@ char str[];
 const int N;
 { /* subroutine to return 24 characters with the time and date */
 #define NCTIME 24
-  char *buffer;
+  char *buffer, timebuf[32];
   time_t curtime;
-  struct tm *loctime;
+  struct tm *loctime, tmbuf;
   int k, n;
   n = N;
   /* Get the current time. */
   curtime = time (NULL);
   /* Convert it to local time representation. */
-  loctime = localtime (&curtime);
+  loctime = localtime_r (&curtime, &tmbuf); /* reentrant for spcat-obj */
   /* copy the date and time in the standard format. */
   if (loctime != NULL) {
-    buffer=asctime (loctime);
+    buffer=asctime_r (loctime, timebuf);
     k= (int) strlen(str);
     n -= NCTIME + 2;
     while(k < n) str[k++]=' ';
@@ -38,6 +38,11 @@
 
 
 #define MAXQNX  13
+typedef struct {  /* one line of the .cat (and .out) listing */
+  double frq, err, strr, strlg, elow;
+  int igup, iqnfmt;
+  char sqn[4*MAXQN + 2];
+} CATLINE;
 typedef struct {
   /*@owned@*/ /*@null@*/ double *eigblk;
   /*@owned@*/ /*@null@*/ double *egyblk;
@@ -55,6 +60,9 @@ int simt(int isiz, int jsiz, double *s, double *t, double *u,
                                     const unsigned int ndel, 
                                     /*@out@*/ SBLK *blk);
 SBLK *sblk_alloc(const int nstruct, const unsigned mxdm);
+static void putline(FILE *luout, FILE *lucat, BOOL prfrq, BOOL prir,
+                    BOOL *first, int itd, long itag, const CATLINE *ln);
+static BOOL inwindow(const spcs_t *spcs, double lo, double hi);
 
 /********************************************************************/
 #define PR_DELAY 6   /* seconds delay between informational messages */
@@ -178,9 +186,12 @@ int spcat(spcs_t *spcs, char *filebufs[], size_t bufsizes[]) /* Must have NFILE
   int iqnfmt, idf, itd, nqn, npar, isiz, jsiz, nsize_p, maxqn, ktsp, ibcd, ndbcd;
   int jmax, nfmt, iposv, iv, newfmt, globfmt, isneg, catqn, maxv;
   BOOL prir, prder, prfrq, preig, pregy, prstr, diag, first, ifdump;
+  BOOL window, outside, haveout;
+  double emin, emax, epmin, epmax, strlgmax;
+  CATLINE line, lnout;
   unsigned int ndel, maxdm;
   short iqni[MAXQN + MAXQNX];
-  char /* *fname[NFILE+1], */ titl[NCARD], sgup[4];
+  char /* *fname[NFILE+1], */ titl[NCARD];
 
   zero = 1.5e-38;
   bigerr = 999.9999;
@@ -206,7 +217,8 @@ int spcat(spcs_t *spcs, char *filebufs[], size_t bufsizes[]) /* Must have NFILE
   first = (fgetstr(titl, NCARD, luint) <= 0);
   if (!first) {
     chtime(titl, 82); 
-    fputs(titl, stdout);
+    if (!spcs->quiet)
+      fputs(titl, stdout);
     fputs(titl, luout);
     first = (fgetstr(titl, NCARD, luint) <= 0);
   }
@@ -506,6 +518,12 @@ int spcat(spcs_t *spcs, char *filebufs[], size_t bufsizes[]) /* Must have NFILE
     maxqn = MAXQNX;
   ktsp = -1;
   lucat = fopenbw(&filebufs[ecat], &bufsizes[ecat]);
+  /* Lines outside the caller's window are not written, except for the
+     strongest line if it is outside; callers scale intensities by it */
+  window = (spcs->winmax > spcs->winmin);
+  haveout = FALSE;
+  strlgmax = -HUGE_VAL;
+  emin = emax = 0.;
   /**********************************************************************/
 
   /* START MAJOR LOOP OVER BLOCKS */
@@ -550,6 +568,13 @@ int spcat(spcs_t *spcs, char *filebufs[], size_t bufsizes[]) /* Must have NFILE
       break;
     dedp = egy + isiz;
     hamx(spcs, iblk, isiz, npar, idpar, par, egy, teig, dedp, pmix, ifdump);
+    if (window && spcs->pruneblocks) {
+      emin = emax = egy[0];
+      for (i = 1; i < isiz; ++i) {
+        if (egy[i] < emin) emin = egy[i];
+        if (egy[i] > emax) emax = egy[i];
+      }
+    }
     /* print out energies and compute partition function */
     if (prfrq) {
       fprintf(luout, " ENERGIES FOR BLOCK NUMBER %3d, INDEX-DEGEN-ENERGY-",
@@ -677,6 +702,17 @@ int spcat(spcs_t *spcs, char *filebufs[], size_t bufsizes[]) /* Must have NFILE
       teigp = pblk->eigblk;
       if (teigp == NULL)
         teigp = s[0];
+      if (window && spcs->pruneblocks && pblk->egyblk != NULL) {
+        /* skip pairs with no transition frequencies in the window */
+        egyp = pblk->egyblk;
+        epmin = epmax = egyp[0];
+        for (j = 1; j < jsiz; ++j) {
+          if (egyp[j] < epmin) epmin = egyp[j];
+          if (egyp[j] > epmax) epmax = egyp[j];
+        }
+        if (!inwindow(spcs, emin - epmax, emax - epmin))
+          continue;
+      }
       idgn = 0;
       ij = 0;
       for (i = 0; i < npdip; ++i) {     /*  get intensity */
@@ -771,62 +807,64 @@ int spcat(spcs_t *spcs, char *filebufs[], size_t bufsizes[]) /* Must have NFILE
           }
           if (strlg < thrshf)
             continue;
+          outside = window && (frq < spcs->winmin || frq > spcs->winmax);
+          if (outside) {
+            if (haveout && strlg <= lnout.strlg)
+              continue;
+          } else if (strlg > strlgmax) {
+            strlgmax = strlg;
+          }
           /* calculate errors */
           err = calerr(nfit, var, derv);
           if (err > bigerr)
             err = bigerr;
           elow /= cmc;
-          if (first) {
-            fputs(" FREQUENCY-EST.ERROR.-LINE.STR. DIP**2-LGSTR.-ITD,",
-                  luout);
-            fputs("-GUP-I.D.-QNFORM-QUANTUM NUMBERS\n", luout);
-            first = FALSE;
-          }
-          if (prfrq) {
-            fprintf(luout, "%13.4f %8.4f %12.5E %8.4f %2d",
-                    frq, err, strr, strlg, itd);
-            fprintf(luout, "%10.4f %3d %7ld %4d %s\n",
-                    elow, igup, itag, iqnfmt, sqn);
+          line.frq = frq; line.err = err; line.strr = strr;
+          line.strlg = strlg; line.elow = elow;
+          line.igup = igup; line.iqnfmt = iqnfmt;
+          memcpy(line.sqn, sqn, sizeof(sqn));
+          if (outside) { /* strongest line outside the window so far */
+            lnout = line;
+            haveout = TRUE;
+            continue;
           }
           ++nline;
-          gupfmt(igup, sgup); sgup[3] = '\0';
-          if (prir) {
-            fprintf(lucat, "%13.6f%8.6f%8.4f%2d%10.4f%s%7ld%4d",
-                    frq, err, strlg, itd, elow, sgup, itag, iqnfmt);
-          } else if (frq < 99999999.) {
-            fprintf(lucat, "%13.4f%8.4f%8.4f%2d%10.4f%s%7ld%4d",
-                    frq, err, strlg, itd, elow, sgup, itag, iqnfmt);
-          } else {
-            fprintf(lucat, "%13.3f%8.3f%8.3f%2d%10.4f%s%7ld%4d",
-                    frq, err, strlg, itd, elow, sgup, itag, iqnfmt);
-          }
-          fputs(sqn,lucat); fputc('\n',lucat);
+          putline(luout, lucat, prfrq, prir, &first, itd, itag, &line);
         }
       }
     } while (jblk != iblk);
   }
+  if (haveout && lnout.strlg > strlgmax) {
+    ++nline;
+    putline(luout, lucat, prfrq, prir, &first, itd, itag, &lnout);
+  }
   teig = teigp = NULL;
   /****************************************************************/
 
   /* print partition function */
 
   if (ifdump) {
-    fputs(warn, stdout);
+    if (!spcs->quiet)
+      fputs(warn, stdout);
     fputs(warn, luout);
   }
-  printf(       "INITIAL Q = %14.4f, NEW Q IS RELATIVE TO MIN.EGY.= %14.4f\n",
+  if (!spcs->quiet)
+    printf(     "INITIAL Q = %14.4f, NEW Q IS RELATIVE TO MIN.EGY.= %14.4f\n",
                 qrot, egymin);
   fprintf(luout,"INITIAL Q = %14.4f, NEW Q IS RELATIVE TO MIN.EGY.= %14.4f\n",
           qrot, egymin);
-  printf(" NUMBER OF LINES = %6ld\n", nline);
+  if (!spcs->quiet)
+    printf(" NUMBER OF LINES = %6ld\n", nline);
   fprintf(luout," NUMBER OF LINES = %6ld\n", nline);
-  fputs(headq, stdout);
+  if (!spcs->quiet)
+    fputs(headq, stdout);
   fputs(headq, luout);
   for (i = 0; i < ntemp; ++i) {
     qlog = -100;
     if (qsum[i] > zero)
       qlog = log10(qsum[i]);
-    printf(       " %10.3f %14.4f %9.4f\n", temp[i], qsum[i], qlog);
+    if (!spcs->quiet)
+      printf(     " %10.3f %14.4f %9.4f\n", temp[i], qsum[i], qlog);
     fprintf(luout," %10.3f %14.4f %9.4f\n", temp[i], qsum[i], qlog);
   }
   if (pregy)
@@ -870,6 +908,44 @@ int spcat(spcs_t *spcs, char *filebufs[], size_t bufsizes[]) /* Must have NFILE
   return 0;
 }                               /* main */
 
+static void putline(FILE *luout, FILE *lucat, BOOL prfrq, BOOL prir,
+                    BOOL *first, int itd, long itag, const CATLINE *ln)
+{ /* write one line to the .out listing and the .cat file */
+  char sgup[4];
+  if (*first) {
+    fputs(" FREQUENCY-EST.ERROR.-LINE.STR. DIP**2-LGSTR.-ITD,", luout);
+    fputs("-GUP-I.D.-QNFORM-QUANTUM NUMBERS\n", luout);
+    *first = FALSE;
+  }
+  if (prfrq) {
+    fprintf(luout, "%13.4f %8.4f %12.5E %8.4f %2d",
+            ln->frq, ln->err, ln->strr, ln->strlg, itd);
+    fprintf(luout, "%10.4f %3d %7ld %4d %s\n",
+            ln->elow, ln->igup, itag, ln->iqnfmt, ln->sqn);
+  }
+  gupfmt(ln->igup, sgup); sgup[3] = '\0';
+  if (prir) {
+    fprintf(lucat, "%13.6f%8.6f%8.4f%2d%10.4f%s%7ld%4d",
+            ln->frq, ln->err, ln->strlg, itd, ln->elow, sgup, itag,
+            ln->iqnfmt);
+  } else if (ln->frq < 99999999.) {
+    fprintf(lucat, "%13.4f%8.4f%8.4f%2d%10.4f%s%7ld%4d",
+            ln->frq, ln->err, ln->strlg, itd, ln->elow, sgup, itag,
+            ln->iqnfmt);
+  } else {
+    fprintf(lucat, "%13.3f%8.3f%8.3f%2d%10.4f%s%7ld%4d",
+            ln->frq, ln->err, ln->strlg, itd, ln->elow, sgup, itag,
+            ln->iqnfmt);
+  }
+  fputs(ln->sqn, lucat); fputc('\n', lucat);
+} /* putline */
+
+static BOOL inwindow(const spcs_t *spcs, double lo, double hi)
+{ /* can a frequency +-[lo, hi] be in the window? */
+  return (hi >= spcs->winmin && lo <= spcs->winmax) ||
+    (hi >= -spcs->winmax && lo <= -spcs->winmin);
+} /* inwindow */
+
 int qnfmt(iqu, nqn, sqn)
 short *iqu;
 int nqn;
@@ -52,6 +52,17 @@ typedef struct { /* local dipole information */ /* From spinv.c */
 struct spcat_state {
   /* SPCAT static variables moved here to allow thread/session safety */
 
+  /* Set by the caller: don't echo the summary to stdout */
+  BOOL quiet;
+  /* Set by the caller: only write lines in [winmin, winmax] to .cat
+     (all lines if winmax <= winmin). The strongest line is also written
+     if it is outside, as callers scale intensities by it. */
+  double winmin, winmax;
+  /* Set by the caller: with a window, skip the intensity calculation for
+     pairs of blocks that have no transitions in it. Their lines are
+     missing, including the strongest line if it is one of them. */
+  BOOL pruneblocks;
+
   /* from spcat-obj.c ibufof, uninitialized (i.e. to zero) */
   FILE *scratch;		/* Close me when freeing */
   long maxrec, lsizb;
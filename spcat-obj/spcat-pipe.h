@@ -0,0 +1,68 @@
+#ifndef _HAVE_SPCAT_PIPE_H
+/* Framing used between ga-spectroscopy (--spcat-pool) and "spcat --server".
+ *
+ * A request is the .int buffer followed by the .var buffer; the reply is the
+ * .cat buffer. Each buffer is a uint64_t byte count in native byte order
+ * followed by that many bytes. Both ends always run on the same machine.
+ * The server exits when its input is closed, and also if SPCAT fails, so
+ * end-of-file in place of a reply means the request was not processed.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+/* Largest buffer either end will accept */
+#define SPCAT_PIPE_MAX ((uint64_t)1<<31)
+
+/* Write all len bytes of buf to fd. Returns 0 on success, -1 on error. */
+static inline int spcat_pipe_write(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  while ( len > 0 ) {
+    ssize_t rc = write(fd, p, len);
+    if ( rc < 0 && errno == EINTR ) continue;
+    if ( rc <= 0 ) return -1;
+    p += rc; len -= rc;
+  }
+  return 0;
+}
+
+/* Read exactly len bytes from fd into buf. Returns 0 on success, 1 on
+ * end-of-file before the first byte, -1 on error or a truncated read. */
+static inline int spcat_pipe_read(int fd, void *buf, size_t len) {
+  char *p = buf;
+  size_t got = 0;
+  while ( got < len ) {
+    ssize_t rc = read(fd, p+got, len-got);
+    if ( rc < 0 && errno == EINTR ) continue;
+    if ( rc < 0 ) return -1;
+    if ( rc == 0 ) return got ? -1 : 1;
+    got += rc;
+  }
+  return 0;
+}
+
+/* Send one buffer. Returns 0 on success, -1 on error. */
+static inline int spcat_pipe_send(int fd, const char *buf, size_t len) {
+  uint64_t n = len;
+  if ( spcat_pipe_write(fd, &n, sizeof(n)) ) return -1;
+  return spcat_pipe_write(fd, buf, len);
+}
+
+/* Receive one buffer into a new malloc'd, NUL-terminated *buf (which must
+ * be freed by the caller). Returns 0 on success, 1 on end-of-file before the
+ * buffer started, -1 on error. */
+static inline int spcat_pipe_recv(int fd, char **buf, size_t *len) {
+  uint64_t n;
+  int rc = spcat_pipe_read(fd, &n, sizeof(n));
+  *buf = NULL; *len = 0;
+  if ( rc ) return rc;
+  if ( n > SPCAT_PIPE_MAX || ( *buf = malloc(n+1) ) == NULL ) return -1;
+  if ( spcat_pipe_read(fd, *buf, n) ) { free(*buf); *buf = NULL; return -1; }
+  (*buf)[n] = 0;
+  *len = n;
+  return 0;
+}
+
+#define _HAVE_SPCAT_PIPE_H
+#endif
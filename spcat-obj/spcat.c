@@ -3,6 +3,43 @@
 #include <stdlib.h>
 #include <string.h>
 #include "spcat-obj.h"
+#include "spcat-pipe.h"
+
+/* Serve requests framed as described in spcat-pipe.h on stdin/stdout until
+ * stdin is closed. */
+int serve(void) {
+  int in = STDIN_FILENO, out;
+  /* Keep the reply channel private; SPCAT's own messages go to stderr. */
+  if ( ( out = dup(STDOUT_FILENO) ) == -1 ||
+       dup2(STDERR_FILENO, STDOUT_FILENO) == -1 ) {
+    perror("spcat: Can't redirect stdout");
+    return 1;
+  }
+  while ( 1 ) {
+    char *buffers[NFILE];
+    size_t bufsizes[NFILE];
+    spcs_t x;
+    int i, rc;
+    memset(buffers, 0, sizeof(buffers));
+    memset(bufsizes, 0, sizeof(bufsizes));
+    rc = spcat_pipe_recv(in, &buffers[eint], &bufsizes[eint]);
+    if ( rc == 1 ) break; /* Done */
+    if ( rc == 0 ) rc = spcat_pipe_recv(in, &buffers[evar], &bufsizes[evar]);
+    if ( rc != 0 ) { fprintf(stderr,"spcat: Bad request\n"); return 1; }
+    if ( init_spcs(&x) ) { fprintf(stderr,"init_spcs error\n"); return 1; }
+    x.quiet = TRUE;
+    rc = spcat(&x, buffers, bufsizes);
+    if ( free_spcs(&x) ) { fprintf(stderr,"free_spcs error\n"); return 1; }
+    /* Exit without a reply, so the client sees the request as failed */
+    if ( rc != 0 ) { fprintf(stderr,"spcat: SPCAT failed\n"); return 1; }
+    if ( spcat_pipe_send(out, buffers[ecat], bufsizes[ecat]) ) {
+      perror("spcat: Can't send reply");
+      return 1;
+    }
+    for ( i = 0; i < NFILE; i++ ) if ( buffers[i] ) free(buffers[i]);
+  }
+  return 0;
+}
 
 int main(int argc, char *argv[]) {
   char *buffers[NFILE];
@@ -11,7 +48,11 @@ int main(int argc, char *argv[]) {
   int i = 0;
   memset(buffers, 0, sizeof(buffers));
   memset(bufsizes, 0, sizeof(bufsizes));
-  if ( argc != 2 ) { printf("Usage: spcat BASENAME\n"); exit(1); }
+  if ( argc == 2 && strcmp(argv[1], "--server") == 0 ) return serve();
+  if ( argc != 2 ) {
+    printf("Usage: spcat BASENAME\n       spcat --server\n");
+    exit(1);
+  }
   fn = strrchr(argv[1], '.');
   if ( fn ) fn[0] = (char)0; /* Remove filename extension */
   fn = malloc(strlen(argv[1])+5);